@@ -0,0 +1,794 @@
+#ifndef CPU_TRACER_H
+#define CPU_TRACER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/matrix.hpp>
+
+#include "light_clusters.h"
+#include "primitives.h"
+#include "scene.h"
+
+// A CPU port of shaders/raytrace_quad.frag
+//
+// Useful for checking the shader's output, and for trying out acceleration
+// techniques without fighting the glsl compiler.
+//
+// Primary rays are traced in packets: Each 8x8 pixel tile builds a frustum from
+// its corner rays, primitives outside the frustum are culled once for the
+// whole tile, and the survivors are intersected against all rays in the packet
+// at once (Structure-of-arrays loops, which the compiler vectorises with the
+// flags in run.sh - The sphere loop needs -fno-math-errno, otherwise std::sqrt
+// keeps a branch to set errno and the loop stays scalar. Check with -fopt-info-vec).
+// Secondary rays (reflection, transparency, shadows) use single ray traversal,
+// in the same way as the shader.
+class CpuTracer {
+  public:
+    // Limits and constants - MAKE SURE THESE MATCH THE SHADER!
+    static constexpr int limit_reflection_and_transparency_depth = 8;
+    static constexpr float limit_inf = 1e20f;
+    static constexpr float limit_epsilon = 1e-12f;
+    static constexpr float limit_acne_factor = 1e-4f;
+    static constexpr float limit_min_surface_thickness = 1e-3f;
+    static constexpr bool limit_subray_shadows_enabled = false;
+    static constexpr int limit_multi_hit_max = 8;
+
+    // Packet size for primary rays, tile_size x tile_size pixels
+    static constexpr int tile_size = 8;
+    static constexpr int packet_size = tile_size * tile_size;
+
+    // Features - Equivalent to the ENABLE_ defines in the shader
+    bool enable_shadows = true;
+    bool enable_reflections = true;
+    bool enable_transparency = true;
+    bool enable_patterns = true;
+    bool enable_multi_hit_transparency = true;
+
+    // If false primary rays are traced one pixel at a time, as the shader does
+    bool use_packets = true;
+
+    uint32_t width, height;
+
+    // Output colour, bottom row first (Same as gl_FragCoord)
+    std::vector<glm::vec4> image;
+
+    // Timings and stats from the last render
+    double primary_ms = 0.0;
+    double total_ms = 0.0;
+    uint64_t primitive_tests = 0;
+    uint64_t bounces = 0;
+    uint64_t shadow_rays = 0;
+
+    // Per pixel primitive tests, bounces and shadow rays from the last render, see ray_cost.h
+    std::vector<glm::uvec4> ray_cost;
+
+    CpuTracer(uint32_t w, uint32_t h)
+    : width(w), height(h)
+    {
+      image.resize(width * height);
+      primary_hits.resize(width * height);
+      ray_cost.resize(width * height);
+    }
+
+    // Render the scene
+    // viewParams - width pixels, height pixels, fov(rad), nearz
+    void render(const Scene& scene, const glm::mat4& viewMatrix, const glm::vec4& viewParams) {
+      auto start = std::chrono::steady_clock::now();
+      prepare(scene, viewMatrix, viewParams);
+      primitive_tests = 0;
+      bounces = 0;
+      shadow_rays = 0;
+
+      // Pass 1: First hit for every pixel
+      if( use_packets ) {
+        for( uint32_t y = 0; y < height; y += tile_size ) {
+          for( uint32_t x = 0; x < width; x += tile_size ) {
+            trace_primary_packet(x, y);
+          }
+        }
+      } else {
+        for( uint32_t y = 0; y < height; y++ ) {
+          for( uint32_t x = 0; x < width; x++ ) {
+            auto tests = primitive_tests;
+            Ray r = ray_for_pixel(x, y);
+            Intersection hit;
+            if( !ray_hit_first(r, hit) ) hit.i = -1;
+            primary_hits[y * width + x] = {hit.t, hit.i};
+            ray_cost[y * width + x] = {static_cast<uint32_t>(primitive_tests - tests), 0, 0, 0};
+          }
+        }
+      }
+      auto primary_end = std::chrono::steady_clock::now();
+
+      // Pass 2: Shading, and any secondary rays
+      for( uint32_t y = 0; y < height; y++ ) {
+        for( uint32_t x = 0; x < width; x++ ) {
+          glm::uvec4 before = {static_cast<uint32_t>(primitive_tests), static_cast<uint32_t>(bounces), static_cast<uint32_t>(shadow_rays), 0};
+          image[y * width + x] = shade_pixel(x, y, primary_hits[y * width + x]);
+          glm::uvec4 after = {static_cast<uint32_t>(primitive_tests), static_cast<uint32_t>(bounces), static_cast<uint32_t>(shadow_rays), 0};
+          ray_cost[y * width + x] += after - before;
+        }
+      }
+      auto end = std::chrono::steady_clock::now();
+
+      primary_ms = std::chrono::duration<double, std::milli>(primary_end - start).count();
+      total_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    // Write the last render to a binary ppm
+    void write_ppm(const std::string& path) const {
+      std::ofstream file(path, std::ios::binary);
+      if( !file ) throw std::runtime_error("Failed to open " + path);
+      file << "P6\n" << width << " " << height << "\n255\n";
+      for( int y = static_cast<int>(height) - 1; y >= 0; y-- ) {
+        for( uint32_t x = 0; x < width; x++ ) {
+          const auto& c = image[y * width + x];
+          for( auto k = 0; k < 3; k++ ) {
+            float v = std::isfinite(c[k]) ? std::clamp(c[k], 0.0f, 1.0f) : 0.0f;
+            file.put(static_cast<char>(v * 255.0f + 0.5f));
+          }
+        }
+      }
+    }
+
+  private:
+    enum class PrimitiveType { Null, Sphere, PlaneXZ };
+
+    // Per-frame copy of a primitive, with the matrices the shader
+    // recomputes for every ray calculated once
+    struct PreparedPrimitive {
+      PrimitiveType type = PrimitiveType::Null;
+      glm::mat4 modelMatrix;
+      glm::mat4 inverseMatrix;
+      glm::mat4 normalMatrix;
+      int material = 0;
+      float pattern_type = 0.0f;
+      glm::vec4 pattern;
+
+      // World space bounds, for culling
+      // - Sphere: Bounding sphere
+      // - PlaneXZ: Point on the plane and its normal
+      glm::vec4 centre;
+      float radius = 0.0f;
+      glm::vec4 normal;
+    };
+
+    struct Ray {
+      glm::vec4 origin;
+      glm::vec4 direction;
+    };
+
+    struct Intersection {
+      float t = limit_inf;   // Intersection distance along the ray
+      int i = 0;             // primitive index
+      bool inside = false;   // true if intersection is within an object
+      glm::vec4 pos;         // Intersection position
+      glm::vec4 eye;         // Intersection -> eye vector
+      glm::vec4 normal;      // Intersection normal
+      glm::vec4 ray_reflect; // Direction of reflected ray
+      glm::vec2 uv;          // Intersection texture coord on primitive
+    };
+
+    // The nearest hits along a ray, sorted by t. Equivalent to MultiHit in the shader
+    struct MultiHit {
+      Ray r;
+      int count = 0;
+      int next = 0;
+      float t[limit_multi_hit_max];
+      int i[limit_multi_hit_max];
+      glm::vec2 uv[limit_multi_hit_max];
+    };
+
+    // Result of the first hit pass, i == -1 for a miss
+    struct PrimaryHit {
+      float t;
+      int i;
+    };
+
+    std::vector<PreparedPrimitive> primitives;
+    std::vector<Material> materials;
+    std::vector<PointLight> lights;
+    std::vector<PrimaryHit> primary_hits;
+
+    glm::vec4 viewParams;
+    glm::mat4 inverseViewMatrix;
+    glm::vec4 eye;
+    float half_width = 0.0f;
+    float half_height = 0.0f;
+    float frag_size = 0.0f;
+
+    void prepare(const Scene& scene, const glm::mat4& viewMatrix, const glm::vec4& params) {
+      materials = scene.materials;
+      lights = scene.lights;
+
+      primitives.clear();
+      for( const auto& p : scene.primitives ) {
+        PreparedPrimitive pp;
+        if( p.type == "sphere" ) pp.type = PrimitiveType::Sphere;
+        else if( p.type == "plane_xz" ) pp.type = PrimitiveType::PlaneXZ;
+        pp.modelMatrix = p.modelMatrix;
+        pp.inverseMatrix = glm::inverse(p.modelMatrix);
+        pp.normalMatrix = glm::transpose(pp.inverseMatrix);
+        pp.material = static_cast<int>(p.meta[1]);
+        pp.pattern_type = p.meta[2];
+        pp.pattern = p.pattern;
+
+        pp.centre = p.modelMatrix * glm::vec4(0.0, 0.0, 0.0, 1.0);
+        if( pp.type == PrimitiveType::Sphere ) {
+          // Longest axis of the ellipsoid - Assumes modelMatrix is only translate/rotate/scale
+          pp.radius = std::max({
+            glm::length(glm::vec3(p.modelMatrix[0].x, p.modelMatrix[0].y, p.modelMatrix[0].z)),
+            glm::length(glm::vec3(p.modelMatrix[1].x, p.modelMatrix[1].y, p.modelMatrix[1].z)),
+            glm::length(glm::vec3(p.modelMatrix[2].x, p.modelMatrix[2].y, p.modelMatrix[2].z))});
+        } else if( pp.type == PrimitiveType::PlaneXZ ) {
+          pp.normal = pp.normalMatrix * glm::vec4(0.0, 1.0, 0.0, 0.0);
+          pp.normal.w = 0.0;
+        }
+        primitives.push_back(pp);
+      }
+
+      // Camera parameters, as ray_for_pixel
+      viewParams = params;
+      inverseViewMatrix = glm::inverse(viewMatrix);
+      eye = inverseViewMatrix * glm::vec4(0.0, 0.0, 0.0, 1.0);
+
+      float half_view_range = std::tan(viewParams.z / 2.0f);
+      float aspect_ratio = viewParams.x / viewParams.y;
+      if( aspect_ratio >= 1.0f ) {
+        half_width = half_view_range;
+        half_height = half_view_range / aspect_ratio;
+      } else {
+        half_width = half_view_range * aspect_ratio;
+        half_height = half_view_range;
+      }
+      frag_size = (half_width * 2.0f) / viewParams.x;
+    }
+
+    //// Ray functions
+    static glm::vec4 ray_to_position(const Ray& r, float t) { return r.origin + (r.direction * t); }
+
+    Ray ray_tf_world_to_model(const Ray& r, const PreparedPrimitive& p) const {
+      return {p.inverseMatrix * r.origin, p.inverseMatrix * r.direction};
+    }
+
+    // World space ray direction through a point on the image plane
+    // ox, oy are in pixels, as (vUV * viewParams.xy) + 0.5 in the shader
+    glm::vec4 camera_direction(float ox, float oy) const {
+      glm::vec4 frag_world = {
+        half_width - ox * frag_size,
+        -(half_height - oy * frag_size),
+        -1.0,
+        1.0
+      };
+      return glm::normalize((inverseViewMatrix * frag_world) - eye);
+    }
+
+    Ray ray_for_pixel(uint32_t x, uint32_t y) const {
+      // vUV is sampled at the pixel centre
+      float ox = (static_cast<float>(x) + 0.5f) + 0.5f;
+      float oy = (static_cast<float>(y) + 0.5f) + 0.5f;
+      return {eye, camera_direction(ox, oy)};
+    }
+
+    //// Primitive functions, as primitive_functions/*.frag
+    int sphere_intersect(int i, const Ray& ray, Intersection (&intersections)[2]) const {
+      Ray r = ray_tf_world_to_model(ray, primitives[i]);
+
+      glm::vec4 sphere_to_ray = r.origin - glm::vec4(0.0, 0.0, 0.0, 1.0);
+      float a = glm::dot(r.direction, r.direction);
+      float b = 2.0f * glm::dot(r.direction, sphere_to_ray);
+      float c = glm::dot(sphere_to_ray, sphere_to_ray) - 1.0f;
+      float discriminant = (b * b) - (4.0f * a * c);
+      if( discriminant < 0.0f ) {
+        return 0;
+      }
+
+      float t1 = (-b - std::sqrt(discriminant)) / (2.0f * a);
+      float t2 = (-b + std::sqrt(discriminant)) / (2.0f * a);
+
+      int num_intersections = 0;
+      intersections[0].i = i; intersections[1].i = i;
+      if( std::abs(t1 - t2) < limit_epsilon ) { intersections[0].t = t1; intersections[1].t = t2; num_intersections = 1; }
+      else if( t1 < t2 ) { intersections[0].t = t1; intersections[1].t = t2; num_intersections = 2; }
+      else if( t2 < t1 ) { intersections[0].t = t2; intersections[1].t = t1; num_intersections = 2; }
+
+      intersections[0].uv = sphere_uv(r, t1);
+      intersections[1].uv = sphere_uv(r, t2);
+      return num_intersections;
+    }
+
+    static glm::vec2 sphere_uv(const Ray& model_ray, float t) {
+      glm::vec4 p = ray_to_position(model_ray, t);
+      glm::vec2 uv;
+      uv.y = std::acos(p.x / p.y);
+      uv.x = std::acos(p.y);
+      return uv;
+    }
+
+    int plane_xz_intersect(int i, const Ray& ray, Intersection (&intersections)[2]) const {
+      Ray r = ray_tf_world_to_model(ray, primitives[i]);
+
+      if( std::abs(r.direction.y) < limit_epsilon ) {
+        return 0;
+      }
+
+      float t = (- r.origin.y) / r.direction.y;
+      intersections[0].i = i;
+      intersections[0].t = t;
+      intersections[0].uv = plane_xz_uv(r, t);
+      return 1;
+    }
+
+    static glm::vec2 plane_xz_uv(const Ray& model_ray, float t) {
+      glm::vec4 p = ray_to_position(model_ray, t);
+      return {p.x / 10.0f, p.z / 10.0f};
+    }
+
+    int calc_primitive_intersect(int i, const Ray& ray, Intersection (&intersections)[2]) {
+      primitive_tests++;
+      switch( primitives[i].type ) {
+        case PrimitiveType::Sphere: return sphere_intersect(i, ray, intersections);
+        case PrimitiveType::PlaneXZ: return plane_xz_intersect(i, ray, intersections);
+        default: break;
+      }
+      intersections[0].t = limit_inf; intersections[1].t = limit_inf;
+      return 0;
+    }
+
+    glm::vec4 calc_primitive_normal(int i, const glm::vec4& p) const {
+      const auto& prim = primitives[i];
+      glm::vec4 n = {0.0, 0.0, 0.0, 0.0};
+      if( prim.type == PrimitiveType::Sphere ) {
+        n = (prim.inverseMatrix * p) - glm::vec4(0.0, 0.0, 0.0, 1.0);
+        n = prim.normalMatrix * n;
+      } else if( prim.type == PrimitiveType::PlaneXZ ) {
+        n = prim.normal;
+      } else {
+        return n;
+      }
+      n.w = 0.0;
+      return glm::normalize(n);
+    }
+
+    // uv of a hit found by the packet tracer, which only records t
+    glm::vec2 calc_primitive_uv(int i, const Ray& ray, float t) const {
+      Ray r = ray_tf_world_to_model(ray, primitives[i]);
+      if( primitives[i].type == PrimitiveType::Sphere ) return sphere_uv(r, t);
+      if( primitives[i].type == PrimitiveType::PlaneXZ ) return plane_xz_uv(r, t);
+      return {0.0, 0.0};
+    }
+
+    //// Primary ray packets
+    // Frustum of a tile, as 4 inward facing planes through the eye
+    struct Frustum {
+      glm::vec3 normals[4];
+      glm::vec4 corners[4];
+    };
+
+    Frustum tile_frustum(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) const {
+      // Corner rays pass through the outer edges of the tile's pixels
+      float ox0 = static_cast<float>(x0) + 0.5f;
+      float ox1 = static_cast<float>(x1) + 0.5f;
+      float oy0 = static_cast<float>(y0) + 0.5f;
+      float oy1 = static_cast<float>(y1) + 0.5f;
+
+      Frustum f;
+      f.corners[0] = camera_direction(ox0, oy0);
+      f.corners[1] = camera_direction(ox1, oy0);
+      f.corners[2] = camera_direction(ox1, oy1);
+      f.corners[3] = camera_direction(ox0, oy1);
+
+      glm::vec4 centre = f.corners[0] + f.corners[1] + f.corners[2] + f.corners[3];
+      for( auto k = 0; k < 4; k++ ) {
+        const auto& a = f.corners[k];
+        const auto& b = f.corners[(k + 1) % 4];
+        glm::vec3 n = glm::normalize(glm::cross(glm::vec3(a.x, a.y, a.z), glm::vec3(b.x, b.y, b.z)));
+        if( n.x * centre.x + n.y * centre.y + n.z * centre.z < 0.0f ) n = -n;
+        f.normals[k] = n;
+      }
+      return f;
+    }
+
+    // true if primitive i can't be hit by any ray within the frustum
+    bool frustum_cull(const Frustum& f, const PreparedPrimitive& p) const {
+      if( p.type == PrimitiveType::Sphere ) {
+        glm::vec3 c = {p.centre.x - eye.x, p.centre.y - eye.y, p.centre.z - eye.z};
+        for( const auto& n : f.normals ) {
+          if( glm::dot(n, c) < -p.radius * (1.0f + 1e-4f) ) return true;
+        }
+        return false;
+      }
+      if( p.type == PrimitiveType::PlaneXZ ) {
+        // Infinite plane - Only missed if every corner ray heads away from it
+        float side = glm::dot(eye - p.centre, p.normal);
+        if( side == 0.0f ) return false;
+        for( const auto& d : f.corners ) {
+          if( glm::dot(d, p.normal) * side < 0.0f ) return false;
+        }
+        return true;
+      }
+      return true;
+    }
+
+    void trace_primary_packet(uint32_t x0, uint32_t y0) {
+      uint32_t x1 = std::min(x0 + tile_size, width);
+      uint32_t y1 = std::min(y0 + tile_size, height);
+      Frustum f = tile_frustum(x0, y0, x1, y1);
+
+      // Packet in structure-of-arrays form
+      float dx[packet_size], dy[packet_size], dz[packet_size];
+      float best_t[packet_size];
+      int best_i[packet_size];
+      int n = 0;
+      for( uint32_t y = y0; y < y1; y++ ) {
+        for( uint32_t x = x0; x < x1; x++ ) {
+          glm::vec4 d = ray_for_pixel(x, y).direction;
+          dx[n] = d.x; dy[n] = d.y; dz[n] = d.z;
+          best_t[n] = limit_inf;
+          best_i[n] = -1;
+          n++;
+        }
+      }
+
+      uint32_t tested = 0;
+      for( int i = 0; i < static_cast<int>(primitives.size()); i++ ) {
+        const auto& p = primitives[i];
+        if( frustum_cull(f, p) ) continue;
+        primitive_tests += n;
+        tested++;
+
+        // The origin is shared by all rays in the packet, so only transformed once
+        const auto& m = p.inverseMatrix;
+        glm::vec4 o = m * eye;
+
+        if( p.type == PrimitiveType::Sphere ) {
+          // sphere_to_ray, w is 0 for an affine modelMatrix
+          float sx = o.x, sy = o.y, sz = o.z;
+          for( int k = 0; k < n; k++ ) {
+            float mx = m[0].x * dx[k] + m[1].x * dy[k] + m[2].x * dz[k];
+            float my = m[0].y * dx[k] + m[1].y * dy[k] + m[2].y * dz[k];
+            float mz = m[0].z * dx[k] + m[1].z * dy[k] + m[2].z * dz[k];
+            float a = mx * mx + my * my + mz * mz;
+            float b = 2.0f * (mx * sx + my * sy + mz * sz);
+            float c = (sx * sx + sy * sy + sz * sz) - 1.0f;
+            float discriminant = (b * b) - (4.0f * a * c);
+            float sq = std::sqrt(std::max(discriminant, 0.0f));
+            float t1 = (-b - sq) / (2.0f * a);
+            float t2 = (-b + sq) / (2.0f * a);
+            // Nearest non-negative hit, a grazing hit only counts once
+            float t = t1 >= 0.0f ? t1 : ((t2 - t1 >= limit_epsilon && t2 >= 0.0f) ? t2 : limit_inf);
+            t = discriminant < 0.0f ? limit_inf : t;
+            bool closer = t < best_t[k];
+            best_t[k] = closer ? t : best_t[k];
+            best_i[k] = closer ? i : best_i[k];
+          }
+        } else if( p.type == PrimitiveType::PlaneXZ ) {
+          for( int k = 0; k < n; k++ ) {
+            float my = m[0].y * dx[k] + m[1].y * dy[k] + m[2].y * dz[k];
+            float t = (- o.y) / my;
+            t = (std::abs(my) < limit_epsilon || !(t >= 0.0f)) ? limit_inf : t;
+            bool closer = t < best_t[k];
+            best_t[k] = closer ? t : best_t[k];
+            best_i[k] = closer ? i : best_i[k];
+          }
+        }
+      }
+
+      n = 0;
+      for( uint32_t y = y0; y < y1; y++ ) {
+        for( uint32_t x = x0; x < x1; x++ ) {
+          primary_hits[y * width + x] = {best_t[n], best_i[n]};
+          ray_cost[y * width + x] = {tested, 0, 0, 0};
+          n++;
+        }
+      }
+    }
+
+    //// Ray intersection functions, as the shader
+    bool ray_hit_first(const Ray& r, Intersection& intersection) {
+      intersection.t = limit_inf;
+      bool result = false;
+      for( int i = 0; i < static_cast<int>(primitives.size()); i++ ) {
+        Intersection prim_intersections[2];
+        int ints = calc_primitive_intersect(i, r, prim_intersections);
+        for( int j = 0; j < ints; j++ ) {
+          const auto& si = prim_intersections[j];
+          if( si.t < 0.0f ) continue;
+          if( si.t < intersection.t ) {
+            intersection = si;
+            result = true;
+          }
+        }
+      }
+      return result;
+    }
+
+    bool ray_hit_first_reflection(const Ray& r, Intersection& intersection) {
+      intersection.t = limit_inf;
+      bool result = false;
+      for( int i = 0; i < static_cast<int>(primitives.size()); i++ ) {
+        Intersection prim_intersections[2];
+        int ints = calc_primitive_intersect(i, r, prim_intersections);
+        for( int j = 0; j < ints; j++ ) {
+          Intersection si = prim_intersections[j];
+          compute_intersection_data(r, si);
+          if( si.t < 0.0f ) continue;
+          if( si.inside ) continue;
+          if( si.t < intersection.t ) {
+            intersection = si;
+            result = true;
+          }
+        }
+      }
+      return result;
+    }
+
+    bool ray_hit_first_transparency(const Ray& r, Intersection& intersection, Intersection current_intersection) {
+      intersection.t = limit_inf;
+      bool result = false;
+      bool require_side = !current_intersection.inside;
+      for( int i = 0; i < static_cast<int>(primitives.size()); i++ ) {
+        Intersection prim_intersections[2];
+        int ints = calc_primitive_intersect(i, r, prim_intersections);
+        for( int j = 0; j < ints; j++ ) {
+          Intersection si = prim_intersections[j];
+          compute_intersection_data(r, si);
+          if( si.t < 0.0f ) continue;
+
+          if( si.i == current_intersection.i ) {
+            if( si.inside != require_side ) continue;
+            if( glm::distance(si.pos, current_intersection.pos) < limit_min_surface_thickness ) continue;
+          }
+
+          if( si.t < intersection.t ) {
+            intersection = si;
+            result = true;
+          }
+        }
+      }
+      return result;
+    }
+
+    void multi_hit_insert(MultiHit& hits, const Intersection& si) {
+      if( hits.count == limit_multi_hit_max && si.t >= hits.t[limit_multi_hit_max - 1] ) return;
+
+      int j = std::min(hits.count, limit_multi_hit_max - 1);
+      for( ; j > 0 && hits.t[j - 1] > si.t; j-- ) {
+        hits.t[j] = hits.t[j - 1];
+        hits.i[j] = hits.i[j - 1];
+        hits.uv[j] = hits.uv[j - 1];
+      }
+      hits.t[j] = si.t;
+      hits.i[j] = si.i;
+      hits.uv[j] = si.uv;
+      hits.count = std::min(hits.count + 1, limit_multi_hit_max);
+    }
+
+    void ray_hit_multi(const Ray& r, MultiHit& hits) {
+      hits.r = r;
+      hits.count = 0;
+      hits.next = 0;
+      for( int i = 0; i < static_cast<int>(primitives.size()); i++ ) {
+        Intersection prim_intersections[2];
+        int ints = calc_primitive_intersect(i, r, prim_intersections);
+        for( int j = 0; j < ints; j++ ) {
+          if( prim_intersections[j].t < 0.0f ) continue;
+          multi_hit_insert(hits, prim_intersections[j]);
+        }
+      }
+    }
+
+    bool multi_hit_next_transparency(const Ray& r, MultiHit& hits, Intersection& intersection, Intersection current_intersection) {
+      bool require_side = !current_intersection.inside;
+      for( int pass = 0; pass < 2; pass++ ) {
+        for( ; hits.next < hits.count; hits.next++ ) {
+          Intersection si;
+          si.t = hits.t[hits.next];
+          si.i = hits.i[hits.next];
+          si.uv = hits.uv[hits.next];
+          compute_intersection_data(hits.r, si);
+
+          if( si.i == current_intersection.i ) {
+            if( si.inside != require_side ) continue;
+            if( glm::distance(si.pos, current_intersection.pos) < limit_min_surface_thickness ) continue;
+          }
+
+          hits.next++;
+          intersection = si;
+          return true;
+        }
+
+        if( hits.count < limit_multi_hit_max ) return false;
+        ray_hit_multi(r, hits);
+      }
+      return false;
+    }
+
+    bool ray_hit_first_shadow(const Ray& r, const Intersection& current_intersection, float light_distance) {
+      for( int i = 0; i < static_cast<int>(primitives.size()); i++ ) {
+        Intersection prim_intersections[2];
+        int ints = calc_primitive_intersect(i, r, prim_intersections);
+        for( int j = 0; j < ints; j++ ) {
+          const auto& si = prim_intersections[j];
+          if( si.i == current_intersection.i ) continue;
+          if( si.t < 0.0f ) continue;
+          if( si.t > light_distance ) continue;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void compute_intersection_data(const Ray& r, Intersection& i) const {
+      i.pos = ray_to_position(r, i.t);
+      i.eye = glm::normalize(r.origin - i.pos);
+      i.normal = calc_primitive_normal(i.i, i.pos);
+
+      if( glm::dot(i.normal, i.eye) < 0.0f ) {
+        i.normal = - i.normal;
+        i.inside = true;
+      } else {
+        i.inside = false;
+      }
+
+      i.ray_reflect = glm::reflect(r.direction, i.normal);
+    }
+
+    bool compute_shadow_cast(const Intersection& intersection, const PointLight& l) {
+      if( !l.cast_shadows ) {
+        return false;
+      }
+      shadow_rays++;
+
+      float l_distance = glm::distance(intersection.pos, l.position);
+
+      Ray shadow_ray;
+      shadow_ray.origin = intersection.pos + (limit_acne_factor * intersection.normal);
+      shadow_ray.direction = glm::normalize(l.position - intersection.pos);
+      return ray_hit_first_shadow(shadow_ray, intersection, l_distance);
+    }
+
+    //// Shading functions
+    glm::vec4 primitive_pattern(int i, const glm::vec4& c, const glm::vec2& uv) const {
+      const auto& p = primitives[i];
+      if( !enable_patterns || p.pattern_type != 1.0f ) return c;
+
+      float x_mult = p.pattern.x;
+      float y_mult = p.pattern.y;
+      float x_mix = std::sin(uv.x * x_mult);
+      float y_mix = std::sin(uv.y * y_mult);
+      const glm::vec4 black = {0.0, 0.0, 0.0, 1.0};
+      glm::vec4 result = black;
+
+      if( x_mult > 0.0f ) result += glm::mix(black, c, x_mix);
+      if( y_mult > 0.0f ) result += glm::mix(black, c, y_mix);
+      if( x_mult > 0.0f && y_mult > 0.0f ) result /= 2.0f;
+      return result;
+    }
+
+    const Material& primitive_material(int i) const { return materials[primitives[i].material]; }
+
+    glm::vec4 shade_phong(const Intersection& hit, bool shadows) {
+      const auto& m = primitive_material(hit.i);
+
+      glm::vec4 shade = glm::vec4(0.0);
+      int num_global_lights = 0;
+      for( const auto& light : lights ) {
+        if( light.radius <= 0.0f ) num_global_lights++;
+        float attenuation = LightClusters::attenuation(glm::distance(hit.pos, light.position), light.radius);
+        if( attenuation == 0.0f ) {
+          continue;
+        }
+        glm::vec4 intensity = light.intensity * attenuation;
+
+        glm::vec4 i = glm::normalize(light.position - hit.pos);
+        glm::vec4 s = glm::normalize(glm::reflect(-i, hit.normal));
+
+        shade += primitive_pattern(hit.i, m.ambient, hit.uv) * intensity;
+
+        float i_n = glm::dot(i, hit.normal);
+
+        if( shadows && compute_shadow_cast(hit, light) ) {
+          continue;
+        }
+
+        shade += primitive_pattern(hit.i, m.diffuse, hit.uv) * intensity * std::abs(i_n);
+
+        float s_e = glm::dot(s, hit.eye);
+        if( s_e >= 0.0f ) {
+          float f = std::pow(s_e, m.specular.w);
+          shade += m.specular * intensity * f;
+        }
+      }
+
+      // Averaged over the lights without a radius, as the shader
+      shade = shade / static_cast<float>(std::max(num_global_lights, 1));
+      shade.w = 1.0;
+      return shade;
+    }
+
+    // Shade a pixel, given its first hit. Equivalent to main() in the shader
+    glm::vec4 shade_pixel(uint32_t x, uint32_t y, const PrimaryHit& primary) {
+      if( primary.i < 0 ) {
+        return {0.0, 0.0, 0.0, 1.0};
+      }
+
+      Ray r = ray_for_pixel(x, y);
+      Intersection hit;
+      hit.t = primary.t;
+      hit.i = primary.i;
+      hit.uv = calc_primitive_uv(hit.i, r, hit.t);
+      compute_intersection_data(r, hit);
+      glm::vec4 shade = shade_phong(hit, enable_shadows);
+
+      Material current_m = primitive_material(hit.i);
+      Intersection current_hit = hit;
+      Ray current_ray = r;
+
+      MultiHit transparency_hits;
+      bool transparency_hits_valid = false;
+
+      float shade_factor = 1.0f;
+      int depth = 0;
+      while( depth != limit_reflection_and_transparency_depth ) {
+        float reflectivity = current_m.reflectivity();
+        float transparency = current_m.transparency();
+        if( reflectivity == 0.0f && transparency == 0.0f ) {
+          break;
+        }
+
+        if( reflectivity != 0.0f ) {
+          if( !enable_reflections ) break;
+          bounces++;
+          current_ray.origin = current_hit.pos + (limit_acne_factor * current_hit.normal);
+          current_ray.direction = current_hit.ray_reflect;
+          if( !ray_hit_first_reflection(current_ray, current_hit) ) {
+            break;
+          }
+          compute_intersection_data(current_ray, current_hit);
+          transparency_hits_valid = false;
+
+          shade_factor *= reflectivity;
+          glm::vec4 reflected_shade = shade_phong(current_hit, limit_subray_shadows_enabled && enable_shadows);
+          shade = glm::mix(shade, reflected_shade, shade_factor);
+        }
+        else if( transparency != 0.0f ) {
+          if( !enable_transparency ) break;
+          bounces++;
+          current_ray.origin = current_hit.pos + (limit_acne_factor * (- hit.normal));
+          if( enable_multi_hit_transparency ) {
+            if( !transparency_hits_valid ) {
+              ray_hit_multi(current_ray, transparency_hits);
+              transparency_hits_valid = true;
+            }
+            if( !multi_hit_next_transparency(current_ray, transparency_hits, current_hit, current_hit) ) {
+              break;
+            }
+          } else {
+            if( !ray_hit_first_transparency(current_ray, current_hit, current_hit) ) {
+              break;
+            }
+            compute_intersection_data(current_ray, current_hit);
+          }
+
+          shade_factor *= transparency;
+          glm::vec4 transparent_shade = shade_phong(current_hit, limit_subray_shadows_enabled && enable_shadows);
+          shade = glm::mix(shade, transparent_shade, shade_factor);
+        }
+        current_m = primitive_material(current_hit.i);
+        depth++;
+      }
+
+      return shade;
+    }
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef LIGHT_CLUSTERS_H
+#define LIGHT_CLUSTERS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "primitives.h"
+
+// Lights binned into a world space grid of clusters, for ENABLE_CLUSTERED_LIGHTS
+//
+// Each cluster lists the lights which can reach it - Lights with a radius are
+// only listed in clusters their sphere of influence overlaps, lights without
+// a radius are listed everywhere. Shading then only loops over the lights of
+// the cluster containing the hit.
+//
+// The grid is in world space rather than screen space, as reflection and
+// transparency hits can be anywhere in the scene. It covers the bounds of all
+// lights with a radius, hits outside it use the nearest cluster.
+class LightClusters {
+  public:
+    // MAKE SURE THESE MATCH THE SHADER!
+    static constexpr uint32_t indices_width = 1024;
+    // PERF: Shadow rays per shade, for each cluster
+    static constexpr uint32_t max_shadow_lights = 2;
+
+    glm::ivec3 dims = {16, 8, 16};
+
+    glm::vec3 grid_min = {0.0, 0.0, 0.0};
+    glm::vec3 cell_size = {1.0, 1.0, 1.0};
+    int num_global_lights = 0;
+
+    // Per cluster - offset into indices, count, number of shadow casting lights
+    // Clusters are ordered x, then y, then z
+    std::vector<glm::uvec4> clusters;
+    // Light indices for all clusters, padded to a multiple of indices_width
+    std::vector<uint32_t> indices;
+
+    void build(const std::vector<PointLight>& lights) {
+      // Grid bounds
+      glm::vec3 lo = {0.0, 0.0, 0.0};
+      glm::vec3 hi = {1.0, 1.0, 1.0};
+      bool first = true;
+      num_global_lights = 0;
+      for( const auto& l : lights ) {
+        if( l.radius <= 0.0f ) {
+          num_global_lights++;
+          continue;
+        }
+        glm::vec3 p = {l.position.x, l.position.y, l.position.z};
+        glm::vec3 r = {l.radius, l.radius, l.radius};
+        lo = first ? p - r : glm::min(lo, p - r);
+        hi = first ? p + r : glm::max(hi, p + r);
+        first = false;
+      }
+      grid_min = lo;
+      cell_size = (hi - lo) / glm::vec3(dims);
+
+      // Lights per cluster
+      std::vector<std::vector<uint32_t>> cluster_lights(dims.x * dims.y * dims.z);
+      for( uint32_t i = 0; i < lights.size(); i++ ) {
+        const auto& l = lights[i];
+        if( l.radius <= 0.0f ) {
+          for( auto& c : cluster_lights ) c.push_back(i);
+          continue;
+        }
+
+        glm::vec3 p = {l.position.x, l.position.y, l.position.z};
+        glm::ivec3 c0 = cell(p - glm::vec3(l.radius));
+        glm::ivec3 c1 = cell(p + glm::vec3(l.radius));
+        for( auto z = c0.z; z <= c1.z; z++ ) {
+          for( auto y = c0.y; y <= c1.y; y++ ) {
+            for( auto x = c0.x; x <= c1.x; x++ ) {
+              // Sphere / box overlap
+              glm::vec3 box_lo = grid_min + glm::vec3(x, y, z) * cell_size;
+              glm::vec3 box_hi = box_lo + cell_size;
+              glm::vec3 closest = glm::clamp(p, box_lo, box_hi);
+              if( glm::distance(closest, p) > l.radius ) continue;
+              cluster_lights[cluster_index(x, y, z)].push_back(i);
+            }
+          }
+        }
+      }
+
+      // Flatten, with the most significant shadow casters first
+      clusters.clear();
+      indices.clear();
+      for( auto z = 0; z < dims.z; z++ ) {
+        for( auto y = 0; y < dims.y; y++ ) {
+          for( auto x = 0; x < dims.x; x++ ) {
+            auto& cl = cluster_lights[cluster_index(x, y, z)];
+            glm::vec3 centre = grid_min + (glm::vec3(x, y, z) + glm::vec3(0.5)) * cell_size;
+            std::stable_sort(cl.begin(), cl.end(), [&](uint32_t a, uint32_t b) {
+              if( lights[a].cast_shadows != lights[b].cast_shadows ) return lights[a].cast_shadows;
+              return significance(lights[a], centre) > significance(lights[b], centre);
+            });
+
+            uint32_t shadow_lights = 0;
+            for( auto i : cl ) {
+              if( lights[i].cast_shadows && shadow_lights < max_shadow_lights ) shadow_lights++;
+            }
+            clusters.push_back({static_cast<uint32_t>(indices.size()), static_cast<uint32_t>(cl.size()), shadow_lights, 0});
+            indices.insert(indices.end(), cl.begin(), cl.end());
+          }
+        }
+      }
+      indices.resize(std::max<size_t>(1, (indices.size() + indices_width - 1) / indices_width) * indices_width, 0);
+    }
+
+    // Falloff for lights with a radius - MAKE SURE THIS MATCHES light_attenuation IN THE SHADER!
+    static float attenuation(float d, float radius) {
+      if( radius <= 0.0f ) return 1.0f;
+      float x = std::clamp(1.0f - (d * d) / (radius * radius), 0.0f, 1.0f);
+      return x * x;
+    }
+
+  private:
+    int cluster_index(int x, int y, int z) const { return x + dims.x * (y + dims.y * z); }
+
+    glm::ivec3 cell(const glm::vec3& p) const {
+      glm::vec3 c = (p - grid_min) / cell_size;
+      return {
+        std::clamp(static_cast<int>(std::floor(c.x)), 0, dims.x - 1),
+        std::clamp(static_cast<int>(std::floor(c.y)), 0, dims.y - 1),
+        std::clamp(static_cast<int>(std::floor(c.z)), 0, dims.z - 1)
+      };
+    }
+
+    // Rough contribution of a light at a point, for ordering shadow rays
+    static float significance(const PointLight& l, const glm::vec3& p) {
+      float brightness = l.intensity.x + l.intensity.y + l.intensity.z;
+      if( l.radius <= 0.0f ) return brightness;
+      float d = glm::distance(glm::vec3(l.position.x, l.position.y, l.position.z), p);
+      return brightness * attenuation(d, l.radius);
+    }
+};
+
+#endif
@@ -10,6 +10,11 @@
 #include <vector>
 #include <list>
 #include <filesystem>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 namespace fs = std::filesystem;
 
 #define GL_GLEXT_PROTOTYPES
@@ -22,6 +27,13 @@ namespace fs = std::filesystem;
 #include <glm/gtc/type_ptr.hpp>
 
 #include "primitives.h"
+#include "scene.h"
+#include "cpu_tracer.h"
+#include "light_clusters.h"
+#include "ray_cost.h"
+#include "shader_features.h"
+#include "simulation.h"
+#include "triple_buffer.h"
 
 using namespace glm;
 
@@ -34,6 +46,27 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
 {
   if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
     glfwSetWindowShouldClose(window, GL_TRUE);
+
+  // Toggle shader features - The renderer rebuilds its shader in the background
+  auto simulation = static_cast<Simulation*>(glfwGetWindowUserPointer(window));
+  if (simulation && action == GLFW_PRESS)
+  {
+    auto& features = simulation->features;
+    switch (key)
+    {
+      case GLFW_KEY_1: features.shadows = !features.shadows; break;
+      case GLFW_KEY_2: features.reflections = !features.reflections; break;
+      case GLFW_KEY_3: features.transparency = !features.transparency; break;
+      case GLFW_KEY_4: features.patterns = !features.patterns; break;
+      case GLFW_KEY_5: features.gbuffer_primary = !features.gbuffer_primary; break;
+      case GLFW_KEY_6: features.clustered_lights = !features.clustered_lights; break;
+      case GLFW_KEY_7: features.multi_hit_transparency = !features.multi_hit_transparency; break;
+      case GLFW_KEY_8: features.ray_cost_counters = !features.ray_cost_counters; break;
+      case GLFW_KEY_9: features.multiview = !features.multiview; break;
+      case GLFW_KEY_C: simulation->capture_ray_cost(); break;
+      case GLFW_KEY_L: simulation->toggle_light_field(); break;
+    }
+  }
 }
 
 std::string loadFile(const std::string &path)
@@ -105,8 +138,23 @@ auto load_primitive_shaders(std::string primitiveDir) {
   return results;
 }
 
-std::string buildFragShader(std::string shaderDir, std::map<std::string, float>& typeMap) {
+// Enable/disable '#define NAME' lines in a shader
+// Disabled defines are commented out, enabled defines are added after #version if missing
+void applyDefines(std::string& source, const std::map<std::string, bool>& defines) {
+    for( auto& define: defines ) {
+      const std::string line = "\n#define " + define.first + "\n";
+      auto pos = source.find(line);
+      if( define.second && pos == std::string::npos ) {
+        source.insert(source.find('\n'), line.substr(0, line.size() - 1));
+      } else if( !define.second && pos != std::string::npos ) {
+        source.insert(pos + 1, "// ");
+      }
+    }
+}
+
+std::string buildFragShader(std::string shaderDir, std::map<std::string, float>& typeMap, const std::map<std::string, bool>& defines = {}) {
     std::string fs_source = loadFile(shaderDir + "/raytrace_quad.frag");
+    applyDefines(fs_source, defines);
     const auto primitives = load_primitive_shaders(shaderDir + "/primitive_functions");
     std::string all_prims;
     for( auto& prim: primitives ) {
@@ -140,6 +188,7 @@ std::string buildFragShader(std::string shaderDir, std::map<std::string, float>&
     primInsert << all_prims;
 
     primInsert << "int calc_primitive_intersect(int i, Ray ray, out Intersection[2] intersections) {\n";
+    primInsert << "COUNT_RAY_COST(cost_primitive_tests);\n";
     i = 1u;
     for( auto& prim: primitives ) {
       if( i == 1 )
@@ -173,6 +222,188 @@ std::string buildFragShader(std::string shaderDir, std::map<std::string, float>&
     return fs_source;
 }
 
+// Builds the ray tracing program on a worker thread, so the renderer never stalls on shader compilation
+//
+// The worker has its own GL context, shared with the render context, so the
+// finished program can be used directly by the renderer. The renderer request()s
+// a build and poll()s for the result each frame, continuing to draw with its
+// current program until the new one is ready.
+//
+// The shader directory is also watched - Any change to a file triggers a rebuild
+// with the last requested features.
+// (KHR_parallel_shader_compile would also work, but isn't available everywhere
+// and still parses the shader source on the calling thread)
+class ShaderBuilder
+{
+public:
+  class Result {
+  public:
+    GLuint program = 0;
+    // G-buffer pass, only built if features.hybrid() is set
+    GLuint proxy_program = 0;
+    std::map<std::string, float> typeMap;
+    ShaderFeatures features;
+  };
+
+  // context - A hidden window sharing objects with the render context
+  // (glfw windows must be created on the main thread)
+  ShaderBuilder(GLFWwindow* context, std::string shaderDir)
+  : context(context), shaderDir(shaderDir)
+  {
+    shaders_changed();
+    worker = std::thread(&ShaderBuilder::run, this);
+  }
+
+  ~ShaderBuilder()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+    if (ready) delete_programs(result);
+  }
+
+  // Request a new program, replaces any pending request
+  void request(const ShaderFeatures& features)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      requested = features;
+      have_request = true;
+      pending = true;
+    }
+    cv.notify_all();
+  }
+
+  // Take the most recently built program, if there is one
+  // Never blocks - The worker only holds the lock while publishing
+  bool poll(Result& out)
+  {
+    if (!ready.load(std::memory_order_acquire)) return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    out = result;
+    ready = false;
+    return true;
+  }
+
+private:
+  GLFWwindow* context;
+  std::string shaderDir;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stop = false;
+  bool have_request = false;
+  bool pending = false;
+  ShaderFeatures requested;
+  std::atomic<bool> ready = false;
+  Result result;
+  std::map<std::string, fs::file_time_type> watched;
+
+  // How often to check the shader directory for changes
+  static constexpr auto watch_interval = std::chrono::milliseconds(500);
+
+  void run()
+  {
+    glfwMakeContextCurrent(context);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop)
+    {
+      cv.wait_for(lock, watch_interval, [this]{ return stop || pending; });
+      if (stop) break;
+
+      lock.unlock();
+      bool changed = shaders_changed();
+      lock.lock();
+
+      if (!have_request || (!pending && !changed)) continue;
+      if (changed) std::cout << "Shaders changed, rebuilding" << std::endl;
+      auto features = requested;
+      pending = false;
+
+      lock.unlock();
+      Result built;
+      built.features = features;
+      bool success = build(built);
+      lock.lock();
+
+      if (success)
+      {
+        // Replace any result the renderer hasn't picked up yet
+        if (ready) delete_programs(result);
+        result = built;
+        ready.store(true, std::memory_order_release);
+      }
+    }
+
+    glfwMakeContextCurrent(nullptr);
+  }
+
+  bool build(Result& built)
+  {
+    try
+    {
+      const std::string vs_source = loadFile(shaderDir + (built.features.multiview ? "/raytrace_quad_multiview.vert" : "/raytrace_quad.vert"));
+      auto fs_source = buildFragShader(shaderDir, built.typeMap, built.features.defines());
+
+      auto vs = compileShader(GL_VERTEX_SHADER, vs_source);
+      auto fs = compileShader(GL_FRAGMENT_SHADER, fs_source);
+      built.program = linkProgram(std::list<GLuint>{vs, fs});
+      glDeleteShader(vs);
+      glDeleteShader(fs);
+
+      if (built.features.hybrid())
+      {
+        auto defines = built.features.defines();
+        defines["GBUFFER_PASS"] = true;
+        std::map<std::string, float> proxyTypeMap;
+        const std::string proxy_vs_source = loadFile(shaderDir + "/gbuffer_proxy.vert");
+        auto proxy_fs_source = buildFragShader(shaderDir, proxyTypeMap, defines);
+
+        auto proxy_vs = compileShader(GL_VERTEX_SHADER, proxy_vs_source);
+        auto proxy_fs = compileShader(GL_FRAGMENT_SHADER, proxy_fs_source);
+        built.proxy_program = linkProgram(std::list<GLuint>{proxy_vs, proxy_fs});
+        glDeleteShader(proxy_vs);
+        glDeleteShader(proxy_fs);
+      }
+
+      // Make sure the program is complete before another context uses it
+      glFinish();
+      return true;
+    }
+    catch (std::exception& e)
+    {
+      // Keep rendering with the previous program
+      std::cerr << e.what() << std::endl;
+      delete_programs(built);
+      return false;
+    }
+  }
+
+  static void delete_programs(const Result& r)
+  {
+    if (r.program) glDeleteProgram(r.program);
+    if (r.proxy_program) glDeleteProgram(r.proxy_program);
+  }
+
+  // Check modification times of everything under shaderDir
+  bool shaders_changed()
+  {
+    std::map<std::string, fs::file_time_type> current;
+    std::error_code ec;
+    for (auto& p: fs::recursive_directory_iterator(shaderDir, ec))
+    {
+      if (p.is_regular_file(ec)) current[p.path().string()] = p.last_write_time(ec);
+    }
+    bool changed = !watched.empty() && current != watched;
+    watched = current;
+    return changed;
+  }
+};
+
 class Renderer
 {
 public:
@@ -183,19 +414,54 @@ public:
   GLuint quad_vbo_uv = 0;
   std::map<std::string, GLint> quad_program_uni;
   GLuint primitives_ubo = 0;
-  glm::vec4 eyePos = {4.0, 6.0, 30.0, 1.0};
-
-  std::vector<Material> materials;
-  std::vector<PointLight> lights;
-  std::vector<Primitive> primitives;
+  std::map<std::string, float> typeMap;
+  uint64_t uploaded_scene_version = 0;
+
+  // Hybrid mode - Primary hits rasterised into a G-buffer, see GBUFFER_PASS in the shader
+  GLuint proxy_program = 0;
+  GLuint proxy_vao = 0;
+  GLuint proxy_vbo = 0;
+  std::map<std::string, GLint> proxy_program_uni;
+  GLuint gbuffer_fbo = 0;
+  GLuint gbuffer_textures[2] = {0, 0};
+  GLuint gbuffer_depth = 0;
+
+  // Proxies for infinite planes are squares, this many units across
+  // In hybrid mode planes aren't visible more than half this from their origin (500 units)
+  const float gbuffer_plane_extent = 1000.0;
+
+  // Clustered lighting - Cluster table, light indices and lights, see ENABLE_CLUSTERED_LIGHTS in the shader
+  LightClusters light_clusters;
+  GLuint light_cluster_textures[3] = {0, 0, 0};
+
+  // Ray cost counters - The instrumented shader draws here, see ENABLE_RAY_COST_COUNTERS
+  // - 0: Colour, blitted to the window
+  // - 1: Primitives tested, bounces, shadow rays
+  GLuint cost_fbo = 0;
+  GLuint cost_textures[2] = {0, 0};
+  uint64_t captured_ray_cost = 0;
+
+  // Multi-view - The scene's views are drawn at once, as an atlas filling the window
+  // Views the program has room for (max_iNumViews), read back from the program
+  GLint max_views = 0;
+  // Views in the scene when some last didn't fit, to only report it once
+  size_t dropped_views = 0;
+
+  // Features of the program in use
+  ShaderFeatures program_features;
+
+  ShaderBuilder builder;
+  bool features_requested = false;
+  ShaderFeatures requested_features;
 
   uint32_t width, height;
 
   glm::mat4 viewMatrix;
   std::vector<float> viewParams;
 
-  Renderer(uint32_t w, uint32_t h) 
-  : width(w), height(h)
+  // builder_context - Hidden window for background shader builds, see ShaderBuilder
+  Renderer(uint32_t w, uint32_t h, GLFWwindow* builder_context) 
+  : builder(builder_context, "../../shaders/"), width(w), height(h)
   {
     viewMatrix = glm::mat4(1.0f);
     init();
@@ -203,20 +469,7 @@ public:
 
   void init()
   {
-    // The Scene
-    create_primitives();
-
-    // Shaders
-    const std::string vs_source = loadFile("../../shaders/raytrace_quad.vert");
-    std::map<std::string, float> typeMap;
-    auto fs_source = buildFragShader("../../shaders/", typeMap);
-
-    auto vs = compileShader(GL_VERTEX_SHADER, vs_source);
-    auto fs = compileShader(GL_FRAGMENT_SHADER, fs_source);
-
-    quad_program = linkProgram(std::list<GLuint>{vs, fs});
-    glUseProgram(quad_program);
-
+    // Shaders are built in the background, see render()
     glCreateVertexArrays(1, &quad_vao);
     glBindVertexArray(quad_vao);
 
@@ -249,186 +502,167 @@ public:
     glVertexAttribPointer(1, 2, GL_FLOAT, false, 0, 0);
     glEnableVertexAttribArray(1);
 
-    // Uniform locations & buffers
+    // Buffers
+    glCreateBuffers(1, &primitives_ubo);
+
+    init_gbuffer();
+    init_ray_cost();
+
+    // Minor thing, but we don't need depth testing for full-screen ray tracing
+    // glDisable(GL_DEPTH_TEST);
+
+    initialised = true;
+  }
+
+  // Unit cube for primitive proxies, and the G-buffer itself
+  // The G-buffer holds the first hit per pixel:
+  // - 0: t, primitive index, uv (primitive index -1 for a miss)
+  // - 1: Surface normal
+  void init_gbuffer()
+  {
+    glCreateVertexArrays(1, &proxy_vao);
+    glBindVertexArray(proxy_vao);
+
+    float cube[] = {
+      -1.0, -1.0, -1.0,  1.0, -1.0, -1.0,  1.0,  1.0, -1.0,
+       1.0,  1.0, -1.0, -1.0,  1.0, -1.0, -1.0, -1.0, -1.0,
+      -1.0, -1.0,  1.0,  1.0, -1.0,  1.0,  1.0,  1.0,  1.0,
+       1.0,  1.0,  1.0, -1.0,  1.0,  1.0, -1.0, -1.0,  1.0,
+      -1.0, -1.0, -1.0, -1.0,  1.0, -1.0, -1.0,  1.0,  1.0,
+      -1.0,  1.0,  1.0, -1.0, -1.0,  1.0, -1.0, -1.0, -1.0,
+       1.0, -1.0, -1.0,  1.0,  1.0, -1.0,  1.0,  1.0,  1.0,
+       1.0,  1.0,  1.0,  1.0, -1.0,  1.0,  1.0, -1.0, -1.0,
+      -1.0, -1.0, -1.0,  1.0, -1.0, -1.0,  1.0, -1.0,  1.0,
+       1.0, -1.0,  1.0, -1.0, -1.0,  1.0, -1.0, -1.0, -1.0,
+      -1.0,  1.0, -1.0,  1.0,  1.0, -1.0,  1.0,  1.0,  1.0,
+       1.0,  1.0,  1.0, -1.0,  1.0,  1.0, -1.0,  1.0, -1.0
+    };
+
+    glCreateBuffers(1, &proxy_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, proxy_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(cube), cube, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+    glEnableVertexAttribArray(0);
+
+    glCreateFramebuffers(1, &gbuffer_fbo);
+    glCreateTextures(GL_TEXTURE_2D, 2, gbuffer_textures);
+    for (auto i = 0; i < 2; i++)
+    {
+      glTextureStorage2D(gbuffer_textures[i], 1, GL_RGBA32F, width, height);
+      glTextureParameteri(gbuffer_textures[i], GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTextureParameteri(gbuffer_textures[i], GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glNamedFramebufferTexture(gbuffer_fbo, GL_COLOR_ATTACHMENT0 + i, gbuffer_textures[i], 0);
+    }
+    glCreateRenderbuffers(1, &gbuffer_depth);
+    glNamedRenderbufferStorage(gbuffer_depth, GL_DEPTH_COMPONENT32F, width, height);
+    glNamedFramebufferRenderbuffer(gbuffer_fbo, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gbuffer_depth);
+
+    GLenum drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glNamedFramebufferDrawBuffers(gbuffer_fbo, 2, drawBuffers);
+    if (glCheckNamedFramebufferStatus(gbuffer_fbo, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      throw std::runtime_error("G-buffer framebuffer incomplete");
+    }
+  }
+
+  // Framebuffer for the instrumented shader
+  void init_ray_cost()
+  {
+    glCreateFramebuffers(1, &cost_fbo);
+    glCreateTextures(GL_TEXTURE_2D, 2, cost_textures);
+    glTextureStorage2D(cost_textures[0], 1, GL_RGBA8, width, height);
+    glTextureStorage2D(cost_textures[1], 1, GL_RGBA32UI, width, height);
+    for (auto i = 0; i < 2; i++)
+    {
+      glTextureParameteri(cost_textures[i], GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTextureParameteri(cost_textures[i], GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glNamedFramebufferTexture(cost_fbo, GL_COLOR_ATTACHMENT0 + i, cost_textures[i], 0);
+    }
+
+    GLenum drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glNamedFramebufferDrawBuffers(cost_fbo, 2, drawBuffers);
+    glNamedFramebufferReadBuffer(cost_fbo, GL_COLOR_ATTACHMENT0);
+    if (glCheckNamedFramebufferStatus(cost_fbo, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      throw std::runtime_error("Ray cost framebuffer incomplete");
+    }
+  }
+
+  // Read back the ray cost counters, print the totals and write heatmaps
+  void capture_ray_cost()
+  {
+    std::vector<glm::uvec4> counters(width * height);
+    glGetTextureImage(cost_textures[1], 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, counters.size() * sizeof(glm::uvec4), counters.data());
+
+    RayCost cost(width, height, std::move(counters));
+    std::cout << "Ray cost:" << std::endl;
+    cost.print_totals(std::cout);
+    cost.write_heatmaps("ray_cost");
+  }
+
+  // Switch to a newly built program
+  void use_program(const ShaderBuilder::Result& built)
+  {
+    if (proxy_program) glDeleteProgram(proxy_program);
+    proxy_program = built.proxy_program;
+    if (proxy_program)
+    {
+      proxy_program_uni = {
+        {"viewParams", glGetUniformLocation(proxy_program, "viewParams")},
+        {"viewMatrix", glGetUniformLocation(proxy_program, "viewMatrix")},
+        {"iNumPrimitives", glGetUniformLocation(proxy_program, "iNumPrimitives")},
+        {"iNumMaterials", glGetUniformLocation(proxy_program, "iNumMaterials")},
+        {"iNumLights", glGetUniformLocation(proxy_program, "iNumLights")},
+        {"proxyMatrices", glGetUniformLocation(proxy_program, "proxyMatrices")}
+      };
+    }
+
+    if (quad_program) glDeleteProgram(quad_program);
+    quad_program = built.program;
+    typeMap = built.typeMap;
+    program_features = built.features;
+    glUseProgram(quad_program);
+
+    // Uniform locations
     quad_program_uni = {
       {"viewParams", glGetUniformLocation(quad_program, "viewParams")},
       {"viewMatrix", glGetUniformLocation(quad_program, "viewMatrix")},
       {"iNumPrimitives", glGetUniformLocation(quad_program, "iNumPrimitives")},
       {"iNumMaterials", glGetUniformLocation(quad_program, "iNumMaterials")},
       {"iNumLights", glGetUniformLocation(quad_program, "iNumLights")},
-      {"ubo_0", glGetUniformBlockIndex(quad_program, "ubo_0")}
+      {"ubo_0", glGetUniformBlockIndex(quad_program, "ubo_0")},
+      {"clusterGridMin", glGetUniformLocation(quad_program, "clusterGridMin")},
+      {"clusterCellSize", glGetUniformLocation(quad_program, "clusterCellSize")},
+      {"clusterDims", glGetUniformLocation(quad_program, "clusterDims")},
+      {"iNumGlobalLights", glGetUniformLocation(quad_program, "iNumGlobalLights")},
+      {"multiViewParams", glGetUniformLocation(quad_program, "multiViewParams")},
+      {"multiViewMatrices", glGetUniformLocation(quad_program, "multiViewMatrices")},
+      {"atlasColumns", glGetUniformLocation(quad_program, "atlasColumns")},
+      {"atlasCellSize", glGetUniformLocation(quad_program, "atlasCellSize")},
+      {"atlasSize", glGetUniformLocation(quad_program, "atlasSize")}
     };
 
-    upload_ubo_0(quad_program_uni["ubo_0"], typeMap);
-
-    // Minor thing, but we don't need depth testing for full-screen ray tracing
-    // glDisable(GL_DEPTH_TEST);
+    max_views = 0;
+    if (program_features.multiview)
+    {
+      GLuint index = glGetProgramResourceIndex(quad_program, GL_UNIFORM, "multiViewMatrices[0]");
+      const GLenum prop = GL_ARRAY_SIZE;
+      if (index != GL_INVALID_INDEX) glGetProgramResourceiv(quad_program, GL_UNIFORM, index, 1, &prop, 1, nullptr, &max_views);
+    }
 
-    initialised = true;
-  }
+    // G-buffer textures, on units 0 and 1 (unused unless ENABLE_GBUFFER_PRIMARY)
+    glUniform1i(glGetUniformLocation(quad_program, "gbufferHit"), 0);
+    glUniform1i(glGetUniformLocation(quad_program, "gbufferNormal"), 1);
+    // Light cluster textures, on units 2 to 4 (unused unless ENABLE_CLUSTERED_LIGHTS)
+    glUniform1i(glGetUniformLocation(quad_program, "lightClusters"), 2);
+    glUniform1i(glGetUniformLocation(quad_program, "lightIndices"), 3);
+    glUniform1i(glGetUniformLocation(quad_program, "lightData"), 4);
 
-  void create_primitives() {
-    
-    auto m = Material();
-    glm::vec4 baseColour = {0.7,0.2,0.7,1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    materials.push_back(m);
-    
-    m = Material();
-    baseColour = {0.2,0.7,0.2,1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    materials.push_back(m);
-    
-    m = Material();
-    baseColour = {1.0, 1.0, 1.0, 1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    materials.push_back(m);
-    
-    m = Material();
-    baseColour = {0.9, 0.9, 0.9, 1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    m.specular *= glm::vec4{0.2, 0.2, 0.2, 1.0};
-    m.specular[3] = 1.0;
-    materials.push_back(m);
-
-    m = Material();
-    baseColour = {0.9, 0.9, 0.9, 1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    m.specular *= glm::vec4{0.2, 0.2, 0.2, 1.0};
-    m.specular[3] = 1.0;
-    m.reflectivity() = 0.5;
-    materials.push_back(m);
-
-    m = Material();
-    baseColour = {0.9, 0.9, 0.9, 1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    m.specular *= glm::vec4{0.2, 0.2, 0.2, 1.0};
-    m.specular[3] = 1.0;
-    m.reflectivity() = 1.0;
-    materials.push_back(m);
-
-    m = Material();
-    baseColour = {1.0, 0.1, 0.1, 1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    m.specular[3] = 8.0;
-    m.reflectivity() = 0.3;
-    materials.push_back(m);
-
-    m = Material();
-    baseColour = {0.1, 0.1, 1.0, 1.0};
-    m.ambient *= baseColour;
-    m.diffuse *= baseColour;
-    m.specular[3] = 16.0;
-    m.transparency() = 0.7;
-    materials.push_back(m); 
-
-/////////////
-    
-    auto l = PointLight();
-    l.position = { 0.0, 20.0, 20.0, 1.0 };
-    l.intensity = {0.3, 0.3, 0.3, 1.0 };
-    l.cast_shadows = true;
-    lights.push_back(l);
-
-    l = PointLight();
-    l.position = {-30.0, 20.0, 30.0, 1.0 };
-    l.cast_shadows = false;
-    lights.push_back(l);
- 
-    l = PointLight();
-    l.position = {20.0, 10.0, 0.0, 1.0 };
-    l.cast_shadows = false;
-    lights.push_back(l);
-
-/////////////
-
-    // bigboi
-    Primitive p = Sphere();
-    p.material() = 5;
-    p.modelMatrix = glm::translate(p.modelMatrix, {-3, 2, 0});
-    p.modelMatrix = glm::scale(p.modelMatrix, {2,2,2});
-    primitives.push_back(p);
-
-    // transparentboi
-    p = Sphere();
-    p.material() = 6;
-    p.modelMatrix = glm::translate(p.modelMatrix, {0, 2, 5});
-    p.modelMatrix = glm::scale(p.modelMatrix, {4,4,4});
-    primitives.push_back(p);
-
-    p = Sphere();
-    p.material() = 7;
-    p.modelMatrix = glm::translate(p.modelMatrix, {0, 2, -10});
-    p.modelMatrix = glm::scale(p.modelMatrix, {16, 4, 16});
-    primitives.push_back(p);
-
-    // hugeboi
-    p = Sphere();
-    p.material() = 1;
-    p.modelMatrix = glm::translate(p.modelMatrix, {0, -9, 0});
-    p.modelMatrix = glm::scale(p.modelMatrix, {10,10,10});
-    p.pattern_type() = 1;
-    p.pattern = {64, 0, 0, 0};
-    primitives.push_back(p);
-
-    // smolboi
-    p = Sphere();
-    p.material() = 0;
-    p.modelMatrix = glm::translate(p.modelMatrix, {1,2,0});
-    p.modelMatrix = glm::scale(p.modelMatrix, {0.5,0.5,0.5});
-    primitives.push_back(p);
-
-
-    // The room, 50x50x50
-    glm::vec4 xwall_pattern = { 1.0, 16.0, 0.0, 0.0 };
-    glm::vec4 zwall_pattern = { 8.0, 8.0, 0.0, 0.0 };
-
-    // floor and ceiling
-    p = PlaneXZ();
-    p.material() = 4;
-    primitives.push_back(p);
-
-    // x walls
-    p = PlaneXZ();
-    p.material() = 5;
-    p.modelMatrix = glm::translate(p.modelMatrix, {60,0,0});
-    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(130.0f), glm::vec3{0.0f,0.0f,1.0f});
-    primitives.push_back(p);
-
-    p = PlaneXZ();
-    p.material() = 5;
-    p.modelMatrix = glm::translate(p.modelMatrix, {-60,0,0});
-    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(-130.0f), glm::vec3{0.0f,0.0f,1.0f});
-    primitives.push_back(p);
-
-    // z walls
-    p = PlaneXZ();
-    p.material() = 5;
-    p.modelMatrix = glm::translate(p.modelMatrix, {0.0, 0.0, 60.0});
-    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(-130.0f), glm::vec3{1.0f, 0.0f, 0.0f});
-    primitives.push_back(p);
-
-    p = PlaneXZ();
-    p.material() = 5;
-    p.modelMatrix = glm::translate(p.modelMatrix, {0.0, 0.0, -60.0});
-    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(130.0f), glm::vec3{1.0f, 0.0f, 0.0f});
-    primitives.push_back(p);
-
-    // A translucent plane, splitting the middle of smolboi and bigboi
-    // p = PlaneXZ();
-    // p.material() = 6;
-    // p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(90.0f), glm::vec3{1.0f, 0.0f, 0.0f});
-    // primitives.push_back(p);
+    // Type numbers and buffer layout may have changed with the program
+    uploaded_scene_version = 0;
   }
 
-  void upload_ubo_0(GLint ubo_index, std::map<std::string, float> typeMap ) {
+  void upload_ubo_0(GLint ubo_index, const Scene& scene) {
     // Get the buffer size + offsets
     GLint ubo_size = 0;
     glGetActiveUniformBlockiv(quad_program, ubo_index, GL_UNIFORM_BLOCK_DATA_SIZE, &ubo_size);
@@ -441,61 +675,43 @@ public:
     const uint32_t primitive_size = 32;
 
     // MAKE SURE THESE MATCH THE SHADER!
-    const uint32_t max_lights = 4;
+    const uint32_t max_lights = max_program_lights();
     const uint32_t max_materials = 8;
     const uint32_t max_primitives = 20;
 
+    // Clustered programs keep their lights in a texture instead, see upload_light_clusters
+    const uint32_t ubo_lights = program_features.clustered_lights ? 0 : max_lights;
     const uint32_t lights_offset = 0;
-    const uint32_t materials_offset = max_lights * light_size;
+    const uint32_t materials_offset = ubo_lights * light_size;
     const uint32_t primitives_offset = materials_offset + (max_materials * material_size);
 
-    auto num_lights = lights.size();
+    // Too many lights is expected briefly, while a clustered program builds
+    auto num_lights = scene.lights.size();
     if (num_lights > max_lights)
     {
-      throw std::runtime_error("Too many lights");
+      std::cerr << "Too many lights(" << num_lights << ") in scene, there can only be " << max_lights << " lights" << std::endl;
       num_lights = max_lights;
     }
-    auto num_materials = materials.size();
-    if (num_lights > max_lights)
+    auto num_materials = scene.materials.size();
+    if (num_materials > max_materials)
     {
       throw std::runtime_error("Too many materials");
-      num_lights = max_lights;
     }
-    auto num_primitives = primitives.size();
-    if (num_lights > max_lights)
+    auto num_primitives = scene.primitives.size();
+    if (num_primitives > max_primitives)
     {
       throw std::runtime_error("Too many primitives");
-      num_lights = max_lights;
     }
 
-    for (auto i = 0; i < num_lights; i++)
+    for (auto i = 0; i < num_lights && ubo_lights; i++)
     {
-      auto offset = lights_offset + (i * light_size);
-      auto& l = lights[i];
-      data[offset++] = l.intensity[0];
-      data[offset++] = l.intensity[1];
-      data[offset++] = l.intensity[2];
-      data[offset++] = l.intensity[3];
-
-      data[offset++] = l.position[0];
-      data[offset++] = l.position[1];
-      data[offset++] = l.position[2];
-      data[offset++] = l.position[3];
-
-      if (l.cast_shadows)
-      {
-        data[offset++] = 1.0;
-      }
-      else
-      {
-        data[offset++] = 0.0;
-      }
+      write_light(&data[lights_offset + (i * light_size)], scene.lights[i]);
     }
 
     for (auto i = 0; i < num_materials; i++)
     {
       auto offset = materials_offset + (i * material_size);
-      auto& m = materials[i];
+      auto& m = scene.materials[i];
 
       data[offset++] = m.ambient[0];
       data[offset++] = m.ambient[1];
@@ -521,9 +737,7 @@ public:
     for (auto i = 0; i < num_primitives; i++)
     {
       auto offset = primitives_offset + (i * primitive_size);
-      auto& p = primitives[i];
-
-      p.type_number() = typeMap[p.type];
+      auto& p = scene.primitives[i];
 
       data[offset++] = p.modelMatrix[0][0];
       data[offset++] = p.modelMatrix[0][1];
@@ -542,7 +756,7 @@ public:
       data[offset++] = p.modelMatrix[3][2];
       data[offset++] = p.modelMatrix[3][3];
 
-      data[offset++] = p.meta[0];
+      data[offset++] = typeMap[p.type];
       data[offset++] = p.meta[1];
       data[offset++] = p.meta[2];
       data[offset++] = p.meta[3];
@@ -553,7 +767,6 @@ public:
       data[offset++] = p.pattern[3];
     }
 
-    glCreateBuffers(1, &primitives_ubo);
     glBindBuffer(GL_UNIFORM_BUFFER, primitives_ubo);
     glBindBufferBase(GL_UNIFORM_BUFFER, 0, primitives_ubo);
     glBufferData(GL_UNIFORM_BUFFER, sizeof(data), data, GL_DYNAMIC_DRAW);
@@ -561,12 +774,118 @@ public:
     // std::exit(1);
   }
 
-  void render() {
+  // Light struct, 16 floats - MAKE SURE THIS MATCHES THE SHADER!
+  static void write_light(float* data, const PointLight& l)
+  {
+    auto offset = 0;
+    data[offset++] = l.intensity[0];
+    data[offset++] = l.intensity[1];
+    data[offset++] = l.intensity[2];
+    data[offset++] = l.intensity[3];
+
+    data[offset++] = l.position[0];
+    data[offset++] = l.position[1];
+    data[offset++] = l.position[2];
+    data[offset++] = l.position[3];
+
+    if (l.cast_shadows)
+    {
+      data[offset++] = 1.0;
+    }
+    else
+    {
+      data[offset++] = 0.0;
+    }
+    data[offset++] = l.radius;
+  }
+
+  // Lights in the current program's ubo_0, or lightData texture if clustered
+  // MAKE SURE THESE MATCH THE SHADER!
+  uint32_t max_program_lights() const
+  {
+    return program_features.clustered_lights ? 256 : 4;
+  }
+
+  // Bin the lights into clusters, and upload the cluster table and light indices
+  void upload_light_clusters(const Scene& scene)
+  {
+    auto num_lights = std::min<size_t>(scene.lights.size(), max_program_lights());
+    light_clusters.build({scene.lights.begin(), scene.lights.begin() + num_lights});
+
+    // Lights, one per row of 4 texels
+    std::vector<float> light_data(std::max<size_t>(num_lights, 1) * 16, 0.0f);
+    for (size_t i = 0; i < num_lights; i++)
+    {
+      write_light(&light_data[i * 16], scene.lights[i]);
+    }
+
+    // Sizes change with the lights, so recreate rather than update
+    glDeleteTextures(3, light_cluster_textures);
+    glCreateTextures(GL_TEXTURE_2D, 3, light_cluster_textures);
+    const auto& dims = light_clusters.dims;
+    const auto index_rows = light_clusters.indices.size() / LightClusters::indices_width;
+    glTextureStorage2D(light_cluster_textures[0], 1, GL_RGBA32UI, dims.x, dims.y * dims.z);
+    glTextureSubImage2D(light_cluster_textures[0], 0, 0, 0, dims.x, dims.y * dims.z, GL_RGBA_INTEGER, GL_UNSIGNED_INT, light_clusters.clusters.data());
+    glTextureStorage2D(light_cluster_textures[1], 1, GL_R32UI, LightClusters::indices_width, index_rows);
+    glTextureSubImage2D(light_cluster_textures[1], 0, 0, 0, LightClusters::indices_width, index_rows, GL_RED_INTEGER, GL_UNSIGNED_INT, light_clusters.indices.data());
+    glTextureStorage2D(light_cluster_textures[2], 1, GL_RGBA32F, 4, light_data.size() / 16);
+    glTextureSubImage2D(light_cluster_textures[2], 0, 0, 0, 4, light_data.size() / 16, GL_RGBA, GL_FLOAT, light_data.data());
+    for (auto t : light_cluster_textures)
+    {
+      // Integer textures are incomplete with linear filtering, and all are read with texelFetch
+      glTextureParameteri(t, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTextureParameteri(t, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    glProgramUniform3f(quad_program, quad_program_uni["clusterGridMin"], light_clusters.grid_min.x, light_clusters.grid_min.y, light_clusters.grid_min.z);
+    glProgramUniform3f(quad_program, quad_program_uni["clusterCellSize"], light_clusters.cell_size.x, light_clusters.cell_size.y, light_clusters.cell_size.z);
+    glProgramUniform3i(quad_program, quad_program_uni["clusterDims"], dims.x, dims.y, dims.z);
+    glProgramUniform1i(quad_program, quad_program_uni["iNumGlobalLights"], light_clusters.num_global_lights);
+  }
+
+  void render(const SceneSnapshot& snapshot) {
     if (!initialised)
     {
       return;
     }
 
+    // Rebuild the shader if the feature set changed, then switch to
+    // the new program once it's ready. Until then the old one is used.
+    if (!features_requested || snapshot.features != requested_features)
+    {
+      builder.request(snapshot.features);
+      requested_features = snapshot.features;
+      features_requested = true;
+    }
+    ShaderBuilder::Result built;
+    if (builder.poll(built))
+    {
+      use_program(built);
+    }
+
+    glViewport(0, 0, width, height);
+    // Set clear color to black, fully opaque
+    glClearColor(0.0, 0.0, 0.0, 1.0);
+    // Clear the color buffer with specified clear color
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Nothing to draw with until the first build completes
+    if (!quad_program)
+    {
+      return;
+    }
+
+    const auto& scene = snapshot.scene;
+    if (snapshot.scene_version != uploaded_scene_version)
+    {
+      upload_ubo_0(quad_program_uni["ubo_0"], scene);
+      if (program_features.clustered_lights)
+      {
+        upload_light_clusters(scene);
+      }
+      uploaded_scene_version = snapshot.scene_version;
+    }
+
     // Perspective parameters
     // TODO: This is calculated within the shader, there is no projection matrix
     float fov = 60.0;
@@ -575,19 +894,13 @@ public:
     
     viewParams = {(float)width, (float)height, glm::radians(fov), nearZ};
 
-    float eyeRot = 0.005;
-    glm::mat4 rotMat(1.0f);
-    rotMat = glm::rotate(rotMat, eyeRot, {0.f,1.f,0.f});
-
-    eyePos = rotMat * eyePos;
-
-    viewMatrix = glm::lookAt(glm::vec3{eyePos.x,eyePos.y,eyePos.z}, glm::vec3{0.0, 0.0, 0.0}, glm::vec3{0.0, 1.0, 0.0});
+    viewMatrix = scene.view_matrix();
 
-    glViewport(0, 0, width, height);
-    // Set clear color to black, fully opaque
-    glClearColor(0.0, 0.0, 0.0, 1.0);
-    // Clear the color buffer with specified clear color
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // Hybrid mode - Rasterise the first hits
+    if (proxy_program)
+    {
+      render_gbuffer(scene);
+    }
 
     // Draw the ray traced stuff
     glUseProgram(quad_program);
@@ -596,24 +909,183 @@ public:
     glUniformBlockBinding(quad_program, quad_program_uni["primitives_ubo"], 0);
     glBindBufferBase(GL_UNIFORM_BUFFER, 0, primitives_ubo);
 
-    update_uniforms();
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    if (program_features.clustered_lights)
+    {
+      glBindTextureUnit(2, light_cluster_textures[0]);
+      glBindTextureUnit(3, light_cluster_textures[1]);
+      glBindTextureUnit(4, light_cluster_textures[2]);
+    }
+
+    update_uniforms(scene, quad_program_uni);
+    if (program_features.ray_cost_counters)
+    {
+      // Cleared each frame, in multi-view mode the atlas may not cover it all
+      const float no_colour[] = {0.0, 0.0, 0.0, 1.0};
+      const GLuint no_cost[] = {0, 0, 0, 0};
+      glClearNamedFramebufferfv(cost_fbo, GL_COLOR, 0, no_colour);
+      glClearNamedFramebufferuiv(cost_fbo, GL_COLOR, 1, no_cost);
+      glBindFramebuffer(GL_FRAMEBUFFER, cost_fbo);
+      draw_quad(scene);
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      glBlitNamedFramebuffer(cost_fbo, 0, 0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+      if (snapshot.ray_cost_capture != captured_ray_cost)
+      {
+        capture_ray_cost();
+        captured_ray_cost = snapshot.ray_cost_capture;
+      }
+    }
+    else
+    {
+      draw_quad(scene);
+    }
+  }
+
+  // Draw the ray traced quad - Once per view of the scene in multi-view mode,
+  // all sharing the same program and scene buffers
+  void draw_quad(const Scene& scene)
+  {
+    if (!program_features.multiview)
+    {
+      glDrawArrays(GL_TRIANGLES, 0, 6);
+      return;
+    }
+
+    // Each view is drawn at its own size, in a cell the size of the largest view
+    // Cells fill the window in rows, from the bottom left
+    glm::vec2 cell_size = {1.0, 1.0};
+    for (const auto& v : scene.views)
+    {
+      cell_size = glm::max(cell_size, glm::vec2{v.viewParams.x, v.viewParams.y});
+    }
+    const int columns = std::max(1, static_cast<int>(width / cell_size.x));
+    const int rows = std::max(1, static_cast<int>(height / cell_size.y));
+
+    const int num_views = std::min({static_cast<int>(scene.views.size()), static_cast<int>(max_views), columns * rows});
+    if (num_views < static_cast<int>(scene.views.size()))
+    {
+      if (dropped_views != scene.views.size())
+      {
+        std::cerr << "Too many views(" << scene.views.size() << ") in scene, there can only be "
+          << std::min(max_views, columns * rows) << " views of this size" << std::endl;
+        dropped_views = scene.views.size();
+      }
+    }
+    else
+    {
+      dropped_views = 0;
+    }
+    if (num_views == 0) return;
+
+    std::vector<glm::vec4> params;
+    std::vector<glm::mat4> matrices;
+    for (auto i = 0; i < num_views; i++)
+    {
+      params.push_back(scene.views[i].viewParams);
+      matrices.push_back(scene.views[i].viewMatrix);
+    }
+
+    glUniform1i(quad_program_uni["atlasColumns"], columns);
+    glUniform2f(quad_program_uni["atlasCellSize"], cell_size.x, cell_size.y);
+    glUniform2f(quad_program_uni["atlasSize"], static_cast<float>(width), static_cast<float>(height));
+    glUniform4fv(quad_program_uni["multiViewParams"], num_views, glm::value_ptr(params[0]));
+    glUniformMatrix4fv(quad_program_uni["multiViewMatrices"], num_views, GL_FALSE, glm::value_ptr(matrices[0]));
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, num_views);
+  }
+
+  // Rasterise a bounding proxy for each primitive into the G-buffer
+  // The proxy pass intersects each fragment's ray with just that primitive,
+  // and the depth test keeps the closest hit.
+  void render_gbuffer(const Scene& scene)
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer_fbo);
+    glViewport(0, 0, width, height);
+    const float no_hit[] = {-1.0, -1.0, 0.0, 0.0};
+    const float no_normal[] = {0.0, 0.0, 0.0, 0.0};
+    const float far_depth = 1.0;
+    glClearBufferfv(GL_COLOR, 0, no_hit);
+    glClearBufferfv(GL_COLOR, 1, no_normal);
+    glClearBufferfv(GL_DEPTH, 0, &far_depth);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+
+    glUseProgram(proxy_program);
+    glBindVertexArray(proxy_vao);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, primitives_ubo);
+    update_uniforms(scene, proxy_program_uni);
+
+    // The proxy is a unit cube - Which encloses a sphere, and can be
+    // flattened into a square for a plane
+    const float nearZ = 0.001;
+    const float farZ = gbuffer_plane_extent * 10.0f;
+    const glm::mat4 viewProjection = proxy_projection(nearZ, farZ) * viewMatrix;
+    std::vector<glm::mat4> proxies;
+    for (auto& p : scene.primitives)
+    {
+      if (p.type == "plane_xz")
+      {
+        float e = gbuffer_plane_extent / 2.0f;
+        proxies.push_back(viewProjection * glm::scale(p.modelMatrix, {e, 0.0, e}));
+      }
+      else
+      {
+        proxies.push_back(viewProjection * p.modelMatrix);
+      }
+    }
+    glUniformMatrix4fv(proxy_program_uni["proxyMatrices"], proxies.size(), GL_FALSE, glm::value_ptr(proxies[0]));
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 36, proxies.size());
+
+    glDisable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glBindTextureUnit(0, gbuffer_textures[0]);
+    glBindTextureUnit(1, gbuffer_textures[1]);
+  }
+
+  // Projection matching ray_for_pixel in the shader, for rasterising proxies
+  // The shader's camera is mirrored in x, and offset by half a pixel
+  glm::mat4 proxy_projection(float nearZ, float farZ)
+  {
+    float half_view_range = tan(viewParams[2] / 2.0);
+    float aspect_ratio = viewParams[0] / viewParams[1];
+    float half_width = 0.0;
+    float half_height = 0.0;
+    if (aspect_ratio >= 1.0)
+    {
+      half_width = half_view_range;
+      half_height = half_view_range / aspect_ratio;
+    }
+    else
+    {
+      half_width = half_view_range * aspect_ratio;
+      half_height = half_view_range;
+    }
+
+    glm::mat4 p(0.0f);
+    p[0][0] = -1.0f / half_width;
+    p[1][1] = 1.0f / half_height;
+    p[2][0] = 1.0f / viewParams[0];
+    p[2][1] = 1.0f / viewParams[1];
+    p[2][2] = -(farZ + nearZ) / (farZ - nearZ);
+    p[2][3] = -1.0f;
+    p[3][2] = -(2.0f * farZ * nearZ) / (farZ - nearZ);
+    return p;
   }
 
-  void update_uniforms()
+  void update_uniforms(const Scene& scene, std::map<std::string, GLint>& uniforms)
   {
-    glUniform4f(quad_program_uni["viewParams"],
+    glUniform4f(uniforms["viewParams"],
       viewParams[0],
       viewParams[1],
       viewParams[2],
       viewParams[3]
     );
 
-    glUniform1i(quad_program_uni["iNumPrimitives"], primitives.size());
-    glUniform1i(quad_program_uni["iNumMaterials"], materials.size());
-    glUniform1i(quad_program_uni["iNumLights"], lights.size());
+    glUniform1i(uniforms["iNumPrimitives"], scene.primitives.size());
+    glUniform1i(uniforms["iNumMaterials"], scene.materials.size());
+    glUniform1i(uniforms["iNumLights"], std::min<size_t>(scene.lights.size(), max_program_lights()));
 
-    glUniformMatrix4fv(quad_program_uni["viewMatrix"], 1, GL_FALSE, glm::value_ptr(viewMatrix));
+    glUniformMatrix4fv(uniforms["viewMatrix"], 1, GL_FALSE, glm::value_ptr(viewMatrix));
   }
 };
 
@@ -664,8 +1136,77 @@ void APIENTRY glDebugOutput(GLenum source,
     std::cout << std::endl;
 }
 
-int main(void)
+// Scene updates per second on the main thread
+const int simulation_rate = 120;
+
+// Owns the GL context, and draws the latest scene snapshot as fast as possible
+// Never waits on the simulation - If there's no new snapshot the last one is drawn again
+void render_thread(GLFWwindow* window, GLFWwindow* builder_context, uint32_t w, uint32_t h, TripleBuffer<SceneSnapshot>& snapshots, std::atomic<bool>& running)
+{
+  glfwMakeContextCurrent(window);
+
+  int flags; glGetIntegerv(GL_CONTEXT_FLAGS, &flags);
+  if (flags & GL_CONTEXT_FLAG_DEBUG_BIT)
+  {
+      glEnable(GL_DEBUG_OUTPUT);
+      glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS); 
+      glDebugMessageCallback(glDebugOutput, nullptr);
+      glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_TRUE);
+  } 
+
+  // glfwSwapInterval(1);
+
+  {
+    // Scoped so any pending build is deleted while the context is still current
+    Renderer renderer(w, h, builder_context);
+
+    while (running)
+    {
+      snapshots.update();
+      renderer.render(snapshots.read_buffer());
+
+      glfwSwapBuffers(window);
+    }
+  }
+
+  glfwMakeContextCurrent(nullptr);
+}
+
+// Render a single frame with the CPU tracer, no window required
+// Renders with per-pixel primary rays, then with packets, to compare the two
+int run_cpu(uint32_t w, uint32_t h)
+{
+  Scene scene;
+  float fov = 60.0;
+  float nearZ = 1.0;
+  glm::vec4 viewParams = {(float)w, (float)h, glm::radians(fov), nearZ};
+
+  CpuTracer tracer(w, h);
+  for( auto packets : {false, true} ) {
+    tracer.use_packets = packets;
+    tracer.render(scene, scene.view_matrix(), viewParams);
+    std::cout << (packets ? "Packet" : "Per-pixel") << " primary rays: "
+      << "first hit " << tracer.primary_ms << "ms, "
+      << "frame " << tracer.total_ms << "ms, "
+      << tracer.primitive_tests << " primitive tests" << std::endl;
+  }
+  tracer.write_ppm("cpu_render.ppm");
+
+  RayCost cost(w, h, tracer.ray_cost);
+  std::cout << "Ray cost:" << std::endl;
+  cost.print_totals(std::cout);
+  cost.write_heatmaps("cpu_ray_cost");
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv)
 {
+  auto w = 800;
+  auto h = 800;
+
+  if (argc > 1 && std::string(argv[1]) == "--cpu")
+    return run_cpu(w, h);
+
   GLFWwindow *window;
 
   glfwSetErrorCallback(error_callback);
@@ -681,8 +1222,6 @@ int main(void)
   glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
   glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, true);  
 
-  auto w = 800;
-  auto h = 800;
   window = glfwCreateWindow(w, h, "Web Tracing CeePlusPlus", NULL, NULL);
   if (!window)
   {
@@ -690,33 +1229,52 @@ int main(void)
     exit(EXIT_FAILURE);
   }
 
-  glfwMakeContextCurrent(window);
-
-  int flags; glGetIntegerv(GL_CONTEXT_FLAGS, &flags);
-  if (flags & GL_CONTEXT_FLAG_DEBUG_BIT)
+  // Hidden window, providing a shared context for background shader builds
+  glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+  GLFWwindow* builder_context = glfwCreateWindow(1, 1, "", NULL, window);
+  if (!builder_context)
   {
-      glEnable(GL_DEBUG_OUTPUT);
-      glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS); 
-      glDebugMessageCallback(glDebugOutput, nullptr);
-      glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_TRUE);
-  } 
-
+    glfwTerminate();
+    exit(EXIT_FAILURE);
+  }
 
   glfwSetKeyCallback(window, key_callback);
-  // glfwSwapInterval(1);
-
-  Renderer renderer(w, h);
 
+  // Input and scene updates run here, rendering runs on its own thread
+  // (glfw requires events to be handled on the main thread)
+  TripleBuffer<SceneSnapshot> snapshots;
+  Simulation simulation;
+  simulation.orbit_view_size = {w / 4.0f, h / 4.0f};
+  glfwSetWindowUserPointer(window, &simulation);
+  simulation.snapshot(snapshots.write_buffer());
+  snapshots.publish();
+
+  std::atomic<bool> running = true;
+  std::thread renderer_thread(render_thread, window, builder_context, w, h, std::ref(snapshots), std::ref(running));
+
+  const auto tick = std::chrono::microseconds(1000000 / simulation_rate);
+  auto last = std::chrono::steady_clock::now();
+  auto next_tick = last;
   while (!glfwWindowShouldClose(window))
   {
-    renderer.render();
+    glfwPollEvents();
 
-    glfwSwapBuffers(window);
+    auto now = std::chrono::steady_clock::now();
+    simulation.tick(std::chrono::duration<double>(now - last).count());
+    last = now;
 
-    glfwPollEvents();
-    //glfwWaitEvents();
+    simulation.snapshot(snapshots.write_buffer());
+    snapshots.publish();
+
+    // If a tick overran don't try to catch up, just carry on from now
+    next_tick = std::max(next_tick + tick, now);
+    std::this_thread::sleep_until(next_tick);
   }
 
+  running = false;
+  renderer_thread.join();
+
+  glfwDestroyWindow(builder_context);
   glfwDestroyWindow(window);
 
   glfwTerminate();
@@ -47,6 +47,8 @@ class PointLight {
   glm::vec4 intensity = {1.0, 1.0, 1.0, 1.0};
   glm::vec4 position = {0.0, 0.0, 0.0, 1.0};
   bool cast_shadows = false;
+  // Range of the light, 0.0 for infinite
+  float radius = 0.0;
 };
 
 #endif
\ No newline at end of file
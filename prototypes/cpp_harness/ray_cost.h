@@ -0,0 +1,79 @@
+#ifndef RAY_COST_H
+#define RAY_COST_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Per-pixel ray cost counters, from the CPU tracer or the shader's ENABLE_RAY_COST_COUNTERS
+// - x: Primitives tested
+// - y: Bounces (reflection and transparency rays)
+// - z: Shadow rays
+class RayCost {
+  public:
+    static constexpr int num_counters = 3;
+    static constexpr const char* names[num_counters] = {"primitive_tests", "bounces", "shadow_rays"};
+
+    uint32_t width, height;
+    // Bottom row first (Same as gl_FragCoord)
+    std::vector<glm::uvec4> counters;
+
+    RayCost(uint32_t w, uint32_t h, std::vector<glm::uvec4> c)
+    : width(w), height(h), counters(std::move(c))
+    {}
+
+    // Total, mean, and worst pixel for each counter
+    void print_totals(std::ostream& out) const {
+      for( auto k = 0; k < num_counters; k++ ) {
+        uint64_t total = 0;
+        uint32_t worst = 0;
+        size_t worst_i = 0;
+        for( size_t i = 0; i < counters.size(); i++ ) {
+          total += counters[i][k];
+          if( counters[i][k] > worst ) {
+            worst = counters[i][k];
+            worst_i = i;
+          }
+        }
+        out << names[k] << ": total " << total
+          << ", mean " << static_cast<double>(total) / counters.size()
+          << ", max " << worst << " at (" << worst_i % width << ", " << worst_i / width << ")" << std::endl;
+      }
+    }
+
+    // One heatmap per counter, prefix_name.ppm. Scaled to the worst pixel, which is white
+    void write_heatmaps(const std::string& prefix) const {
+      for( auto k = 0; k < num_counters; k++ ) {
+        uint32_t worst = 1;
+        for( const auto& c : counters ) worst = std::max(worst, c[k]);
+
+        std::string path = prefix + "_" + names[k] + ".ppm";
+        std::ofstream file(path, std::ios::binary);
+        if( !file ) throw std::runtime_error("Failed to open " + path);
+        file << "P6\n" << width << " " << height << "\n255\n";
+        for( int y = static_cast<int>(height) - 1; y >= 0; y-- ) {
+          for( uint32_t x = 0; x < width; x++ ) {
+            glm::vec3 c = heat(static_cast<float>(counters[y * width + x][k]) / worst);
+            for( auto j = 0; j < 3; j++ ) file.put(static_cast<char>(c[j] * 255.0f + 0.5f));
+          }
+        }
+      }
+    }
+
+  private:
+    // Black -> blue -> red -> yellow -> white
+    static glm::vec3 heat(float v) {
+      const glm::vec3 ramp[] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 1.0}, {1.0, 0.0, 0.0}, {1.0, 1.0, 0.0}, {1.0, 1.0, 1.0}};
+      float f = std::clamp(v, 0.0f, 1.0f) * 4.0f;
+      int i = std::min(static_cast<int>(f), 3);
+      return glm::mix(ramp[i], ramp[i + 1], f - i);
+    }
+};
+
+#endif
@@ -1,5 +1,5 @@
 #!/usr/bin/env sh
 set -e
-g++ --std=c++17 -Werror main.cpp -lglfw -lGLEW -lGL
-./a.out
+g++ --std=c++17 -Werror -O3 -march=native -fno-math-errno -pthread main.cpp -lglfw -lGLEW -lGL
+./a.out "$@"
 
@@ -0,0 +1,270 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "primitives.h"
+
+// A camera for multi-view rendering
+class View {
+  public:
+  glm::mat4 viewMatrix = glm::mat4(1.0f);
+  // width pixels, height pixels, fov(rad), nearz - As viewParams in the shader
+  glm::vec4 viewParams = {1.0, 1.0, glm::radians(60.0f), 1.0};
+};
+
+// The scene being rendered - Shared between the GL renderer and the CPU tracer
+class Scene {
+  public:
+  std::vector<Material> materials;
+  std::vector<PointLight> lights;
+  std::vector<Primitive> primitives;
+
+  glm::vec4 eyePos = {4.0, 6.0, 30.0, 1.0};
+
+  // Cameras rendered as an atlas in multi-view mode, view 0 at the bottom left
+  std::vector<View> views;
+
+  Scene() {
+    create_primitives();
+  }
+
+  glm::mat4 view_matrix() const {
+    return glm::lookAt(glm::vec3{eyePos.x,eyePos.y,eyePos.z}, glm::vec3{0.0, 0.0, 0.0}, glm::vec3{0.0, 1.0, 0.0});
+  }
+
+  // As view_matrix, with the eye rotated further around the origin
+  glm::mat4 orbit_view_matrix(float angle) const {
+    glm::vec4 eye = glm::rotate(glm::mat4(1.0f), angle, {0.f,1.f,0.f}) * eyePos;
+    return glm::lookAt(glm::vec3{eye.x,eye.y,eye.z}, glm::vec3{0.0, 0.0, 0.0}, glm::vec3{0.0, 1.0, 0.0});
+  }
+
+  // count views of size, orbiting the scene from the eye
+  void create_orbit_views(int count, glm::vec2 size) {
+    views.clear();
+    for( auto i = 0; i < count; i++ ) {
+      auto v = View();
+      v.viewMatrix = orbit_view_matrix(glm::radians(360.0f) * i / count);
+      v.viewParams = {size.x, size.y, glm::radians(60.0f), 1.0};
+      views.push_back(v);
+    }
+  }
+
+  // A pair of views from either side of the eye, separation apart
+  void create_stereo_views(float separation, glm::vec2 size) {
+    views.clear();
+    for( auto side : {-0.5f, 0.5f} ) {
+      auto v = View();
+      // Offset along the view's x axis, keeping both views parallel
+      v.viewMatrix = glm::translate(glm::mat4(1.0f), {-side * separation, 0.f, 0.f}) * view_matrix();
+      v.viewParams = {size.x, size.y, glm::radians(60.0f), 1.0};
+      views.push_back(v);
+    }
+  }
+
+  // The 6 faces of a cube map centred on position, +x -x +y -y +z -z
+  // Oriented as GL cube map faces, so each view can be copied straight into its face.
+  // ray_for_pixel mirrors x (see Renderer::proxy_projection), so the views mirror it back.
+  void create_cube_views(const glm::vec3& position, float size) {
+    const glm::vec3 dirs[] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    const glm::vec3 ups[] = {{0, -1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}, {0, -1, 0}, {0, -1, 0}};
+    views.clear();
+    for( auto i = 0; i < 6; i++ ) {
+      auto v = View();
+      v.viewMatrix = glm::scale(glm::mat4(1.0f), {-1.f, 1.f, 1.f}) * glm::lookAt(position, position + dirs[i], ups[i]);
+      v.viewParams = {size, size, glm::radians(90.0f), 0.1};
+      views.push_back(v);
+    }
+  }
+
+  // A grid of small coloured lights just above the floor
+  // Only usable with clustered lighting, the shader has room for 4 lights otherwise
+  void create_light_field() {
+    const int n = 15;
+    const float spacing = 3.0;
+    for( auto z = 0; z < n; z++ ) {
+      for( auto x = 0; x < n; x++ ) {
+        auto l = PointLight();
+        l.position = { (x - n / 2) * spacing, 1.5, (z - n / 2) * spacing, 1.0 };
+        float h = (x + z * n) * 0.37f;
+        l.intensity = { 0.5f + 0.5f * std::sin(h), 0.5f + 0.5f * std::sin(h + 2.1f), 0.5f + 0.5f * std::sin(h + 4.2f), 1.0 };
+        l.cast_shadows = true;
+        l.radius = 5.0;
+        lights.push_back(l);
+      }
+    }
+  }
+
+  void remove_light_field() {
+    lights.erase(std::remove_if(lights.begin(), lights.end(), [](const PointLight& l) { return l.radius > 0.0f; }), lights.end());
+  }
+
+  void create_primitives() {
+    
+    auto m = Material();
+    glm::vec4 baseColour = {0.7,0.2,0.7,1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    materials.push_back(m);
+    
+    m = Material();
+    baseColour = {0.2,0.7,0.2,1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    materials.push_back(m);
+    
+    m = Material();
+    baseColour = {1.0, 1.0, 1.0, 1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    materials.push_back(m);
+    
+    m = Material();
+    baseColour = {0.9, 0.9, 0.9, 1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    m.specular *= glm::vec4{0.2, 0.2, 0.2, 1.0};
+    m.specular[3] = 1.0;
+    materials.push_back(m);
+
+    m = Material();
+    baseColour = {0.9, 0.9, 0.9, 1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    m.specular *= glm::vec4{0.2, 0.2, 0.2, 1.0};
+    m.specular[3] = 1.0;
+    m.reflectivity() = 0.5;
+    materials.push_back(m);
+
+    m = Material();
+    baseColour = {0.9, 0.9, 0.9, 1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    m.specular *= glm::vec4{0.2, 0.2, 0.2, 1.0};
+    m.specular[3] = 1.0;
+    m.reflectivity() = 1.0;
+    materials.push_back(m);
+
+    m = Material();
+    baseColour = {1.0, 0.1, 0.1, 1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    m.specular[3] = 8.0;
+    m.reflectivity() = 0.3;
+    materials.push_back(m);
+
+    m = Material();
+    baseColour = {0.1, 0.1, 1.0, 1.0};
+    m.ambient *= baseColour;
+    m.diffuse *= baseColour;
+    m.specular[3] = 16.0;
+    m.transparency() = 0.7;
+    materials.push_back(m); 
+
+/////////////
+    
+    auto l = PointLight();
+    l.position = { 0.0, 20.0, 20.0, 1.0 };
+    l.intensity = {0.3, 0.3, 0.3, 1.0 };
+    l.cast_shadows = true;
+    lights.push_back(l);
+
+    l = PointLight();
+    l.position = {-30.0, 20.0, 30.0, 1.0 };
+    l.cast_shadows = false;
+    lights.push_back(l);
+ 
+    l = PointLight();
+    l.position = {20.0, 10.0, 0.0, 1.0 };
+    l.cast_shadows = false;
+    lights.push_back(l);
+
+/////////////
+
+    // bigboi
+    Primitive p = Sphere();
+    p.material() = 5;
+    p.modelMatrix = glm::translate(p.modelMatrix, {-3, 2, 0});
+    p.modelMatrix = glm::scale(p.modelMatrix, {2,2,2});
+    primitives.push_back(p);
+
+    // transparentboi
+    p = Sphere();
+    p.material() = 6;
+    p.modelMatrix = glm::translate(p.modelMatrix, {0, 2, 5});
+    p.modelMatrix = glm::scale(p.modelMatrix, {4,4,4});
+    primitives.push_back(p);
+
+    p = Sphere();
+    p.material() = 7;
+    p.modelMatrix = glm::translate(p.modelMatrix, {0, 2, -10});
+    p.modelMatrix = glm::scale(p.modelMatrix, {16, 4, 16});
+    primitives.push_back(p);
+
+    // hugeboi
+    p = Sphere();
+    p.material() = 1;
+    p.modelMatrix = glm::translate(p.modelMatrix, {0, -9, 0});
+    p.modelMatrix = glm::scale(p.modelMatrix, {10,10,10});
+    p.pattern_type() = 1;
+    p.pattern = {64, 0, 0, 0};
+    primitives.push_back(p);
+
+    // smolboi
+    p = Sphere();
+    p.material() = 0;
+    p.modelMatrix = glm::translate(p.modelMatrix, {1,2,0});
+    p.modelMatrix = glm::scale(p.modelMatrix, {0.5,0.5,0.5});
+    primitives.push_back(p);
+
+
+    // The room, 50x50x50
+    glm::vec4 xwall_pattern = { 1.0, 16.0, 0.0, 0.0 };
+    glm::vec4 zwall_pattern = { 8.0, 8.0, 0.0, 0.0 };
+
+    // floor and ceiling
+    p = PlaneXZ();
+    p.material() = 4;
+    primitives.push_back(p);
+
+    // x walls
+    p = PlaneXZ();
+    p.material() = 5;
+    p.modelMatrix = glm::translate(p.modelMatrix, {60,0,0});
+    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(130.0f), glm::vec3{0.0f,0.0f,1.0f});
+    primitives.push_back(p);
+
+    p = PlaneXZ();
+    p.material() = 5;
+    p.modelMatrix = glm::translate(p.modelMatrix, {-60,0,0});
+    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(-130.0f), glm::vec3{0.0f,0.0f,1.0f});
+    primitives.push_back(p);
+
+    // z walls
+    p = PlaneXZ();
+    p.material() = 5;
+    p.modelMatrix = glm::translate(p.modelMatrix, {0.0, 0.0, 60.0});
+    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(-130.0f), glm::vec3{1.0f, 0.0f, 0.0f});
+    primitives.push_back(p);
+
+    p = PlaneXZ();
+    p.material() = 5;
+    p.modelMatrix = glm::translate(p.modelMatrix, {0.0, 0.0, -60.0});
+    p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(130.0f), glm::vec3{1.0f, 0.0f, 0.0f});
+    primitives.push_back(p);
+
+    // A translucent plane, splitting the middle of smolboi and bigboi
+    // p = PlaneXZ();
+    // p.material() = 6;
+    // p.modelMatrix = glm::rotate(p.modelMatrix, glm::radians(90.0f), glm::vec3{1.0f, 0.0f, 0.0f});
+    // primitives.push_back(p);
+  }
+
+};
+
+#endif
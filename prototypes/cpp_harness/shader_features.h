@@ -0,0 +1,48 @@
+#ifndef SHADER_FEATURES_H
+#define SHADER_FEATURES_H
+
+#include <map>
+#include <string>
+
+// Feature set for raytrace_quad.frag
+// Each feature maps to one of the ENABLE_ defines in the shader
+class ShaderFeatures {
+  public:
+    bool shadows = true;
+    bool reflections = true;
+    bool transparency = true;
+    bool patterns = true;
+    // Find every layer of a transparency chain in one traversal
+    bool multi_hit_transparency = true;
+    // Rasterise primary visibility into a G-buffer, rather than tracing it
+    bool gbuffer_primary = false;
+    // Shade with only the lights near each hit, see light_clusters.h
+    bool clustered_lights = false;
+    // Instrumentation build, writing per-pixel ray costs to a second render target
+    bool ray_cost_counters = false;
+    // Render an atlas of views in one draw, see raytrace_quad_multiview.vert
+    bool multiview = false;
+
+    // Hybrid mode is single view only, the G-buffer holds one view
+    bool hybrid() const { return gbuffer_primary && !multiview; }
+
+    // Define name -> enabled
+    std::map<std::string, bool> defines() const {
+      return {
+        {"ENABLE_SHADOWS", shadows},
+        {"ENABLE_REFLECTIONS", reflections},
+        {"ENABLE_TRANSPARENCY", transparency},
+        {"ENABLE_PATTERNS", patterns},
+        {"ENABLE_MULTI_HIT_TRANSPARENCY", multi_hit_transparency},
+        {"ENABLE_GBUFFER_PRIMARY", hybrid()},
+        {"ENABLE_CLUSTERED_LIGHTS", clustered_lights},
+        {"ENABLE_RAY_COST_COUNTERS", ray_cost_counters},
+        {"ENABLE_MULTIVIEW", multiview},
+      };
+    }
+
+    bool operator==(const ShaderFeatures& other) const { return defines() == other.defines(); }
+    bool operator!=(const ShaderFeatures& other) const { return !(*this == other); }
+};
+
+#endif
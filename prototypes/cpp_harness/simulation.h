@@ -0,0 +1,88 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <cstdint>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "scene.h"
+#include "shader_features.h"
+
+// An immutable copy of the scene, passed from the simulation to the renderer
+class SceneSnapshot {
+  public:
+    Scene scene;
+    // Incremented whenever materials/lights/primitives change
+    // The renderer only re-uploads the scene buffers when this changes
+    uint64_t scene_version = 0;
+    ShaderFeatures features;
+    // Incremented to request a ray cost capture, see Renderer::capture_ray_cost
+    uint64_t ray_cost_capture = 0;
+};
+
+// Scene updates, run on the main thread alongside input handling
+// Anything slow in here only delays the next snapshot, not the next frame
+class Simulation {
+  public:
+    Scene scene;
+    uint64_t scene_version = 1;
+    ShaderFeatures features;
+    uint64_t ray_cost_capture = 0;
+
+    // Camera rotation around the origin, radians per second
+    float eyeRotSpeed = 0.3;
+
+    bool light_field = false;
+
+    // Default multi-view cameras - A ring of views orbiting the scene, following the eye
+    // Set orbit_views to 0 to use your own scene.views instead (stereo pairs, cube maps, ...)
+    int orbit_views = 16;
+    glm::vec2 orbit_view_size = {200, 200};
+
+    void tick(double dt) {
+      glm::mat4 rotMat(1.0f);
+      rotMat = glm::rotate(rotMat, eyeRotSpeed * static_cast<float>(dt), {0.f,1.f,0.f});
+      scene.eyePos = rotMat * scene.eyePos;
+
+      if( features.multiview && orbit_views > 0 ) {
+        scene.create_orbit_views(orbit_views, orbit_view_size);
+      }
+    }
+
+    // Call after modifying materials, lights, or primitives
+    void scene_changed() { scene_version++; }
+
+    // Ask the renderer to export its ray costs, using the instrumented shader
+    void capture_ray_cost() {
+      features.ray_cost_counters = true;
+      ray_cost_capture++;
+    }
+
+    // Add/remove the scene's light field, which needs clustered lighting
+    void toggle_light_field() {
+      light_field = !light_field;
+      if( light_field ) {
+        scene.create_light_field();
+        features.clustered_lights = true;
+      } else {
+        scene.remove_light_field();
+      }
+      scene_changed();
+    }
+
+    void snapshot(SceneSnapshot& out) const {
+      out.features = features;
+      out.ray_cost_capture = ray_cost_capture;
+      // Only copy the cameras if the scene itself is unchanged
+      if( out.scene_version != scene_version ) {
+        out.scene = scene;
+        out.scene_version = scene_version;
+      } else {
+        out.scene.eyePos = scene.eyePos;
+        out.scene.views = scene.views;
+      }
+    }
+};
+
+#endif
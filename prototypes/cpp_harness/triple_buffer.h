@@ -0,0 +1,47 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free triple buffer, for a single writer thread and a single reader thread
+//
+// The writer fills write_buffer() and publish()es it, the reader calls update()
+// to pick up the most recent published buffer, then uses read_buffer().
+// Neither side ever waits on the other - If the writer publishes faster than the
+// reader consumes, intermediate buffers are simply dropped.
+template<typename T>
+class TripleBuffer {
+  public:
+    // Buffer owned by the writer
+    T& write_buffer() { return buffers[write_index]; }
+
+    // Swap the write buffer into the middle slot, marking it as new
+    void publish() {
+      uint8_t previous = middle.exchange(write_index | dirty_bit, std::memory_order_acq_rel);
+      write_index = previous & index_mask;
+    }
+
+    // Take the latest published buffer, if there is one
+    // Returns true if read_buffer() changed
+    bool update() {
+      if( !(middle.load(std::memory_order_relaxed) & dirty_bit) ) return false;
+      uint8_t previous = middle.exchange(read_index, std::memory_order_acq_rel);
+      read_index = previous & index_mask;
+      return true;
+    }
+
+    // Buffer owned by the reader
+    const T& read_buffer() const { return buffers[read_index]; }
+
+  private:
+    static constexpr uint8_t index_mask = 0x3;
+    static constexpr uint8_t dirty_bit = 0x4;
+
+    T buffers[3];
+    uint8_t write_index = 0;
+    std::atomic<uint8_t> middle = {1};
+    uint8_t read_index = 2;
+};
+
+#endif
@@ -50,6 +50,22 @@ void sort_intersections( Intersection (&intersections)[limit_in_per_ray_max] ) {
   }
 }
 
+// Insert into a sorted list of the count nearest intersections, without a separate sort
+// If the list is full the furthest intersection is dropped
+// This allows a single traversal to collect the k nearest hits along a ray
+void insert_intersection( Intersection (&intersections)[limit_in_per_ray_max], int& count, const Intersection& intersection ) {
+  // Full, and further than everything we have
+  if( count == limit_in_per_ray_max && intersection.t >= intersections[limit_in_per_ray_max - 1].t ) return;
+
+  // Shift further intersections back, dropping the last if full
+  int i = count < limit_in_per_ray_max ? count : limit_in_per_ray_max - 1;
+  for( ; i > 0 && intersections[i - 1].t > intersection.t; i-- ) {
+    intersections[i] = intersections[i - 1];
+  }
+  intersections[i] = intersection;
+  if( count < limit_in_per_ray_max ) count++;
+}
+
 void print_intersections( Intersection (&intersections)[limit_in_per_ray_max] ) {
     std::cout << "\nIntersections:\n";
     for( int i = 0; i < limit_in_per_ray_max; i++ ) {
@@ -71,4 +87,17 @@ int main(void) {
   sort_intersections(intersections);
 
   print_intersections(intersections);
+
+  // k nearest of more hits than will fit
+  Intersection nearest[limit_in_per_ray_max];
+  init_intersections(nearest);
+  int count = 0;
+  for( int i = 0; i < 25; i++ ) {
+    Intersection hit;
+    init_intersection(hit);
+    hit.t = (i * 37) % 25;
+    insert_intersection(nearest, count, hit);
+  }
+
+  print_intersections(nearest);
 }
\ No newline at end of file
@@ -0,0 +1,19 @@
+#version 300 es
+
+// Bounding proxies for the G-buffer pass (GBUFFER_PASS in raytrace_quad.frag)
+// One instance per primitive - A unit cube, transformed to enclose the primitive
+
+// MAKE SURE THIS MATCHES THE FRAGMENT SHADER!
+const int max_iNumPrimitives = 20;
+
+layout (location=0) in vec3 position;
+
+// Proxy -> clip space, per primitive
+uniform mat4 proxyMatrices[max_iNumPrimitives];
+
+flat out int vPrimitive;
+
+void main() {
+  vPrimitive = gl_InstanceID;
+  gl_Position = proxyMatrices[gl_InstanceID] * vec4(position, 1.0);
+}
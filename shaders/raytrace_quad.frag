@@ -10,19 +10,63 @@ precision highp float;
 #define ENABLE_SHADOWS
 #define ENABLE_REFLECTIONS
 #define ENABLE_TRANSPARENCY
+// Transparency layers found by a single traversal, rather than one traversal per layer
+#define ENABLE_MULTI_HIT_TRANSPARENCY
+#ifndef ENABLE_TRANSPARENCY
+#undef ENABLE_MULTI_HIT_TRANSPARENCY
+#endif
 // TODO: Patterns need some work - Would be extended to texture support or similar
 #define ENABLE_PATTERNS
 
+// Hybrid rendering - Primary hits are rasterised rather than traced
+// - GBUFFER_PASS: Build the shader for the G-buffer pass instead. Rasterises a bounding
+//   proxy per primitive (gbuffer_proxy.vert), and writes the first hit of each pixel.
+// - ENABLE_GBUFFER_PRIMARY: Read the first hit from the G-buffer instead of calling ray_hit_first
+// #define GBUFFER_PASS
+// #define ENABLE_GBUFFER_PRIMARY
+
+// Clustered lighting - Only shade with the lights affecting the hit
+// Lights with a radius are binned into a world space grid of clusters by the renderer,
+// allowing far more lights in the scene. Only the most significant shadow casting
+// lights in each cluster may cast shadows.
+// #define ENABLE_CLUSTERED_LIGHTS
+
+// Instrumentation - Count the work done for each pixel, written to rayCostOut
+// Counts primitives tested (in the generated calc_primitive_intersect), bounces, and shadow rays.
+// First hits rasterised in hybrid mode aren't counted.
+// #define ENABLE_RAY_COST_COUNTERS
+#ifdef GBUFFER_PASS
+#undef ENABLE_RAY_COST_COUNTERS
+#endif
+
+// Multi-view - Render several views as tiles of an atlas, in one draw (raytrace_quad_multiview.vert)
+// Each view has its own multiViewMatrices and multiViewParams entry, rather than viewMatrix/viewParams
+// Not compatible with ENABLE_GBUFFER_PRIMARY, the G-buffer holds a single view
+// #define ENABLE_MULTIVIEW
+
 #define PI 3.1415926538
 
+#ifdef GBUFFER_PASS
+flat in int vPrimitive;
+#else
 in vec3 fragPos;
 in vec2 vUV;
+#endif
 
 // width pixels, height pixels, fov(rad), nearz
 uniform vec4 viewParams;
 
 uniform mat4 viewMatrix;
 
+#ifdef ENABLE_MULTIVIEW
+// Also declared in raytrace_quad_multiview.vert (a mismatch fails to link). The renderer reads the limit back from the program
+const int max_iNumViews = 16;
+flat in int vView;
+// As viewParams/viewMatrix, per view
+uniform vec4 multiViewParams[max_iNumViews];
+uniform mat4 multiViewMatrices[max_iNumViews];
+#endif
+
 // A primitive / object
 // - modelMatrix
 // - meta.x - The type
@@ -47,7 +91,7 @@ struct Primitive {
 struct Light {
   vec4 intensity;  // rgb_
   vec4 position;   // xyz1 (TODO: Support for directional lights)
-  vec4 shadow;     // Cast shadows if x != 0.0, yzw unused
+  vec4 shadow;     // Cast shadows if x != 0.0, y = radius (0.0 for infinite), zw unused
   vec4 pad;
 };
 
@@ -61,8 +105,12 @@ struct Material {
 // Upper limits for scene objects
 const int max_iNumPrimitives = 20;
 const int max_iNumMaterials = 8;
+#ifdef ENABLE_CLUSTERED_LIGHTS
+const int max_iNumLights = 256;
+#else
 // THERE ARE FOUR LIGHTS!
 const int max_iNumLights = 4;
+#endif
 
 uniform int iNumPrimitives;
 uniform int iNumMaterials;
@@ -70,12 +118,50 @@ uniform int iNumLights;
 // This block only contains the primitives, to simplify the buffer upload in js
 layout (std140) uniform ubo_0
 {
+#ifndef ENABLE_CLUSTERED_LIGHTS
   Light lights[max_iNumLights];
+#endif
   Material materials[max_iNumMaterials];
   Primitive primitives[max_iNumPrimitives];
 } ;
 
+#ifdef ENABLE_CLUSTERED_LIGHTS
+// Light clusters, covering clusterDims cells of clusterCellSize from clusterGridMin
+// - lightClusters: Cluster (x,y,z) at texel (x, y + z * clusterDims.y)
+//   r = offset into lightIndices, g = number of lights, b = number of lights which may cast shadows
+// - lightIndices: Light indices for all clusters, light_indices_width per row
+//   Within a cluster the most significant shadow casting lights are first
+// - iNumGlobalLights: Lights without a radius, which the shade is averaged over
+// - lightData: The lights, one per row of 4 texels (As the Light struct)
+//   Not in ubo_0, 256 lights would overflow the minimum GL_MAX_UNIFORM_BLOCK_SIZE (16KB)
+const int light_indices_width = 1024;
+uniform highp usampler2D lightClusters;
+uniform highp usampler2D lightIndices;
+uniform highp sampler2D lightData;
+uniform vec3 clusterGridMin;
+uniform vec3 clusterCellSize;
+uniform ivec3 clusterDims;
+uniform int iNumGlobalLights;
+#endif
+
+#ifdef GBUFFER_PASS
+layout(location = 0) out vec4 gbufferHitOut;    // t, primitive index, uv
+layout(location = 1) out vec4 gbufferNormalOut; // Surface normal
+#elif defined(ENABLE_RAY_COST_COUNTERS)
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out uvec4 rayCostOut;       // Primitives tested, bounces, shadow rays
+#else
 out vec4 fragColor;
+#endif
+
+#ifdef ENABLE_RAY_COST_COUNTERS
+uint cost_primitive_tests = 0u;
+uint cost_bounces = 0u;
+uint cost_shadow_rays = 0u;
+#define COUNT_RAY_COST(counter) counter++
+#else
+#define COUNT_RAY_COST(counter)
+#endif
 
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //// Limits and constants
@@ -93,6 +179,10 @@ const float limit_epsilon = 1e-12;
 const float limit_acne_factor = 1e-4;
 const float limit_min_surface_thickness = 1e-3;
 
+// PERF: Hits kept by a multi-hit traversal (ENABLE_MULTI_HIT_TRANSPARENCY)
+// Transparency chains with more layers than this will traverse again
+const int limit_multi_hit_max = 8;
+
 // PERF: If you've got a really nice gpu or want to melt your PC enable this
 // While it doesn't look as good shadows should really be off after the first
 // intersection, especially if multiple lights have shadows enabled.
@@ -181,12 +271,18 @@ vec4 vector_eye( vec4 p, vec4 eye ) { return normalize(eye - p); }
 vec4 vector_light( vec4 p, Light l ) { return normalize(l.position - p); }
 vec4 vector_light_reflected( vec4 i, vec4 n ) { return normalize(reflect(-i, n)); }
 
-// Pre-compute common vectors used during shading, fill in gaps in existing hit
-// Unless this has been called an intersection's data for these will be undefined
-void compute_intersection_data( Ray r, inout Intersection i ) {
+// Falloff for lights with a radius, reaching zero at the radius
+float light_attenuation( vec4 p, Light l ) {
+  if( l.shadow.y <= 0.0 ) return 1.0;
+  float d = distance(p, l.position);
+  float x = clamp(1.0 - (d * d) / (l.shadow.y * l.shadow.y), 0.0, 1.0);
+  return x * x;
+}
+
+// As compute_intersection_data, for a hit which already has its surface normal
+void compute_intersection_vectors( Ray r, inout Intersection i ) {
   i.pos = ray_to_position(r, i.t);
   i.eye = vector_eye(i.pos, r.origin);
-  i.normal = calc_primitive_normal(i.i, i.pos);
 
   // If the intersection is inside an object flip the normal
   if( dot(i.normal, i.eye) < 0.0 ) {
@@ -200,6 +296,13 @@ void compute_intersection_data( Ray r, inout Intersection i ) {
   // Note: DO NOT compute shadows in here unless you want infinite recursion in your shader ;)
 }
 
+// Pre-compute common vectors used during shading, fill in gaps in existing hit
+// Unless this has been called an intersection's data for these will be undefined
+void compute_intersection_data( Ray r, inout Intersection i ) {
+  i.normal = calc_primitive_normal(i.i, ray_to_position(r, i.t));
+  compute_intersection_vectors(r, i);
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////
 // Ray intersection functions
 // TODO: For now there's multiple, could be largely unified into one function
@@ -224,6 +327,26 @@ bool ray_hit_first( Ray r, inout Intersection intersection ) {
   return result;
 }
 
+#ifdef ENABLE_GBUFFER_PRIMARY
+// First hit from the G-buffer pass, for the current pixel
+uniform highp sampler2D gbufferHit;
+uniform highp sampler2D gbufferNormal;
+
+bool gbuffer_hit_first( Ray r, inout Intersection intersection ) {
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  vec4 h = texelFetch(gbufferHit, p, 0);
+  // Cleared to a negative primitive index
+  if( h.y < 0.0 ) return false;
+
+  intersection.t = h.x;
+  intersection.i = int(h.y);
+  intersection.uv = h.zw;
+  intersection.normal = texelFetch(gbufferNormal, p, 0);
+  compute_intersection_vectors(r, intersection);
+  return true;
+}
+#endif
+
 #ifdef ENABLE_REFLECTIONS
 bool ray_hit_first_reflection( Ray r, inout Intersection intersection ) {
   intersection.t = limit_inf;
@@ -279,6 +402,80 @@ bool ray_hit_first_transparency( Ray r, inout Intersection intersection, in Inte
 
   return result;
 }
+
+#ifdef ENABLE_MULTI_HIT_TRANSPARENCY
+// The nearest hits along a ray, sorted by t
+// Transparency rays don't change direction, so every layer of a
+// transparency chain is somewhere in here.
+struct MultiHit {
+  Ray r;
+  int count;   // Number of hits kept, up to limit_multi_hit_max
+  int next;    // Next hit to consider
+  float t[limit_multi_hit_max];
+  int i[limit_multi_hit_max];
+  vec2 uv[limit_multi_hit_max];
+};
+
+// Insert into the sorted hits, dropping the furthest if full
+void multi_hit_insert( inout MultiHit hits, Intersection si ) {
+  if( hits.count == limit_multi_hit_max && si.t >= hits.t[limit_multi_hit_max - 1] ) return;
+
+  int j = min(hits.count, limit_multi_hit_max - 1);
+  for( ; j > 0 && hits.t[j - 1] > si.t; j-- ) {
+    hits.t[j] = hits.t[j - 1];
+    hits.i[j] = hits.i[j - 1];
+    hits.uv[j] = hits.uv[j - 1];
+  }
+  hits.t[j] = si.t;
+  hits.i[j] = si.i;
+  hits.uv[j] = si.uv;
+  hits.count = min(hits.count + 1, limit_multi_hit_max);
+}
+
+// Collect the nearest limit_multi_hit_max hits along the ray, in one traversal
+void ray_hit_multi( Ray r, inout MultiHit hits ) {
+  hits.r = r;
+  hits.count = 0;
+  hits.next = 0;
+  for( int i = 0; i < iNumPrimitives; i++ ) {
+    Intersection prim_intersections[2];
+    int ints = calc_primitive_intersect(i, r, prim_intersections);
+    for( int j = 0; j < ints; j++ ) {
+      if( prim_intersections[j].t < 0.0 ) continue;
+      multi_hit_insert(hits, prim_intersections[j]);
+    }
+  }
+}
+
+// As ray_hit_first_transparency, taking the next layer from hits
+// If hits were dropped and have run out, traverse again along r
+bool multi_hit_next_transparency( Ray r, inout MultiHit hits, inout Intersection intersection, in Intersection current_intersection ) {
+  bool require_side = !current_intersection.inside;
+  for( int pass = 0; pass < 2; pass++ ) {
+    for( ; hits.next < hits.count; hits.next++ ) {
+      Intersection si;
+      si.t = hits.t[hits.next];
+      si.i = hits.i[hits.next];
+      si.uv = hits.uv[hits.next];
+      compute_intersection_data(hits.r, si);
+
+      if( si.i == current_intersection.i ) {
+        if( si.inside != require_side ) continue;
+        if( distance(si.pos, current_intersection.pos) < limit_min_surface_thickness ) continue;
+      }
+
+      hits.next++;
+      intersection = si;
+      return true;
+    }
+
+    // Every hit along the ray was kept, there's nothing further
+    if( hits.count < limit_multi_hit_max ) return false;
+    ray_hit_multi(r, hits);
+  }
+  return false;
+}
+#endif
 #endif
 
 #ifdef ENABLE_SHADOWS
@@ -314,6 +511,7 @@ bool compute_shadow_cast( Intersection intersection, Light l ) {
     // This light doesn't cast shadows, skip
     return false;
   }
+  COUNT_RAY_COST(cost_shadow_rays);
 
   // Okay, need to check for shadow, down the performance hole we go!
   // Distance from intersection to light - If a hit is closer than this along
@@ -329,15 +527,68 @@ bool compute_shadow_cast( Intersection intersection, Light l ) {
 }
 #endif
 
+#ifdef ENABLE_CLUSTERED_LIGHTS
+// The cluster containing p - Positions outside the grid use the nearest cluster
+uvec4 light_cluster( vec4 p ) {
+  ivec3 c = clamp(ivec3(floor((p.xyz - clusterGridMin) / clusterCellSize)), ivec3(0), clusterDims - 1);
+  return texelFetch(lightClusters, ivec2(c.x, c.y + (c.z * clusterDims.y)), 0);
+}
+
+// Index of the k'th light in a cluster
+int light_cluster_index( uvec4 cluster, int k ) {
+  int i = int(cluster.r) + k;
+  return int(texelFetch(lightIndices, ivec2(i % light_indices_width, i / light_indices_width), 0).r);
+}
+#endif
+
+Light scene_light( int i ) {
+#ifdef ENABLE_CLUSTERED_LIGHTS
+  Light l;
+  l.intensity = texelFetch(lightData, ivec2(0, i), 0);
+  l.position = texelFetch(lightData, ivec2(1, i), 0);
+  l.shadow = texelFetch(lightData, ivec2(2, i), 0);
+  l.pad = vec4(0.0);
+  return l;
+#else
+  return lights[i];
+#endif
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////
 // Shading functions
 vec4 shade_phong( Intersection hit, bool enable_shadows ) {
   // Phong model, calculated in world space
   Material m = primitive_material(hit.i);
 
+#ifdef ENABLE_CLUSTERED_LIGHTS
+  uvec4 cluster = light_cluster(hit.pos);
+  int num_lights = int(cluster.g);
+  int num_global_lights = iNumGlobalLights;
+#else
+  int num_lights = iNumLights;
+  // Lights without a radius, counted as we go
+  int num_global_lights = 0;
+#endif
+
   vec4 shade = vec4(0.0);
-  for( int il = 0; il < iNumLights; il++ ) {
-    Light light = lights[il];
+  for( int k = 0; k < num_lights; k++ ) {
+#ifdef ENABLE_CLUSTERED_LIGHTS
+    int il = light_cluster_index(cluster, k);
+    // Shadow rays for the first few lights only
+    bool light_shadows = enable_shadows && k < int(cluster.b);
+#else
+    int il = k;
+    bool light_shadows = enable_shadows;
+#endif
+    Light light = scene_light(il);
+#ifndef ENABLE_CLUSTERED_LIGHTS
+    if( light.shadow.y <= 0.0 ) num_global_lights++;
+#endif
+    float attenuation = light_attenuation(hit.pos, light);
+    if( attenuation == 0.0 ) {
+      continue;
+    }
+    vec4 intensity = light.intensity * attenuation;
 
     // Incident vector, p -> light
     vec4 i = vector_light(hit.pos, light);
@@ -346,9 +597,9 @@ vec4 shade_phong( Intersection hit, bool enable_shadows ) {
 
     // Ambient component
 #ifdef ENABLE_PATTERNS
-    shade += (primitive_pattern(hit.i, m.ambient, hit.uv) * light.intensity);
+    shade += (primitive_pattern(hit.i, m.ambient, hit.uv) * intensity);
 #else
-    shade += m.ambient * light.intensity;
+    shade += m.ambient * intensity;
 #endif
 
     // Angle between light and surface normal
@@ -362,15 +613,17 @@ vec4 shade_phong( Intersection hit, bool enable_shadows ) {
     //
     // Check if the light is blocked (in shadow)
     // If so diffuse and specular are zero
-    if( enable_shadows && compute_shadow_cast( hit, light ) ) {
+#ifdef ENABLE_SHADOWS
+    if( light_shadows && compute_shadow_cast( hit, light ) ) {
       continue;
     }
+#endif
     
     // Diffuse component
 #ifdef ENABLE_PATTERNS
-    shade += (primitive_pattern(hit.i, m.diffuse, hit.uv) * light.intensity * abs(i_n));
+    shade += (primitive_pattern(hit.i, m.diffuse, hit.uv) * intensity * abs(i_n));
 #else
-    shade += m.diffuse * light.intensity * abs(i_n);
+    shade += m.diffuse * intensity * abs(i_n);
 #endif
 
     // Specular component
@@ -379,20 +632,49 @@ vec4 shade_phong( Intersection hit, bool enable_shadows ) {
     if( s_e >= 0.0 )
     {
       float f = pow(s_e, m.specular.w);
-      shade += (m.specular * light.intensity * f);
+      shade += (m.specular * intensity * f);
     }
   }
 
-  shade = shade / float(iNumLights);
+  // Averaged over the lights without a radius, local lights only brighten the scene
+  shade = shade / float(max(num_global_lights, 1));
   shade.a = 1.0;
   return shade;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Camera for the current pixel
+vec4 view_params() {
+#ifdef ENABLE_MULTIVIEW
+  return multiViewParams[vView];
+#else
+  return viewParams;
+#endif
+}
+
+mat4 view_matrix() {
+#ifdef ENABLE_MULTIVIEW
+  return multiViewMatrices[vView];
+#else
+  return viewMatrix;
+#endif
+}
+
+// Position of the current pixel, 0,0 -> width,height
+vec2 pixel_coord() {
+#ifdef GBUFFER_PASS
+  return gl_FragCoord.xy;
+#else
+  return vUV * view_params().xy;
+#endif
+}
+
 Ray ray_for_pixel() {
   // Camera parameters
-  float half_view_range = tan( viewParams.z / 2.0 );
-  float aspect_ratio = viewParams.x / viewParams.y;
+  vec4 params = view_params();
+  mat4 view = view_matrix();
+  float half_view_range = tan( params.z / 2.0 );
+  float aspect_ratio = params.x / params.y;
   
   float half_width = 0.0;
   float half_height = 0.0;
@@ -403,10 +685,10 @@ Ray ray_for_pixel() {
     half_width = half_view_range * aspect_ratio;
     half_height = half_view_range;
   }
-  float frag_size = (half_width * 2.0) / viewParams.x;
+  float frag_size = (half_width * 2.0) / params.x;
 
   // Center of current pixel, relative to bottom left. 0,0 -> width,height
-  vec2 frag_offset = ((vUV * viewParams.xy) + vec2(0.5)) * frag_size;
+  vec2 frag_offset = (pixel_coord() + vec2(0.5)) * frag_size;
 
   vec4 frag_world = vec4(
     half_width - frag_offset.x,
@@ -419,11 +701,34 @@ Ray ray_for_pixel() {
 
   // Define the ray in world space
   Ray r;
-  r.origin = inverse(viewMatrix) * vec4(0.0, 0.0, 0.0, 1.0);
-  r.direction = normalize((inverse(viewMatrix) * frag_world) - r.origin);
+  r.origin = inverse(view) * vec4(0.0, 0.0, 0.0, 1.0);
+  r.direction = normalize((inverse(view) * frag_world) - r.origin);
   return r;
 }
 
+#ifdef GBUFFER_PASS
+// Exact intersection with the primitive this proxy encloses
+// The depth test keeps the nearest hit per pixel
+void main() {
+  Ray r = ray_for_pixel();
+
+  Intersection hit;
+  hit.t = limit_inf;
+  Intersection prim_intersections[2];
+  int ints = calc_primitive_intersect(vPrimitive, r, prim_intersections);
+  for( int j = 0; j < ints; j++ ) {
+    Intersection si = prim_intersections[j];
+    if( si.t < 0.0 ) continue;
+    if( si.t < hit.t ) hit = si;
+  }
+  if( hit.t == limit_inf ) discard;
+
+  gbufferHitOut = vec4(hit.t, float(hit.i), hit.uv);
+  gbufferNormalOut = calc_primitive_normal(hit.i, ray_to_position(r, hit.t));
+  // Monotonic in t, within the 0-1 depth range
+  gl_FragDepth = hit.t / (hit.t + 1.0);
+}
+#else
 void main() {
 
   Ray r = ray_for_pixel();
@@ -431,15 +736,24 @@ void main() {
   // Perform the first ray intersection
   // and shade the first hit
   Intersection hit;
+#ifdef ENABLE_GBUFFER_PRIMARY
+  if( !gbuffer_hit_first( r, hit ) ) {
+#else
   if( !ray_hit_first( r, hit ) ) {
+#endif
 #ifdef DEBUG
     fragColor = vec4(1.0, 0.0, 1.0, 1.0);
 #else
     fragColor = vec4(0.0, 0.0, 0.0, 1.0);
+#endif
+#ifdef ENABLE_RAY_COST_COUNTERS
+    rayCostOut = uvec4(cost_primitive_tests, cost_bounces, cost_shadow_rays, 0u);
 #endif
     return;
   }
+#ifndef ENABLE_GBUFFER_PRIMARY
   compute_intersection_data( r, hit );
+#endif
   vec4 shade = shade_phong( hit, true );
 
   // And if the surface we hit has special properties spawn additional rays from here
@@ -450,6 +764,12 @@ void main() {
   Intersection current_hit = hit;
   Ray current_ray = r;
 
+#ifdef ENABLE_MULTI_HIT_TRANSPARENCY
+  // Hits along the current transparency chain, filled by its first layer
+  MultiHit transparency_hits;
+  bool transparency_hits_valid = false;
+#endif
+
   // The contribution for the current surface. Compound of each reflectivity factor as we go
   float shade_factor = 1.0;
   // Limit on depth - Hopefully by the time this is hit shade_factor will be tiny
@@ -464,6 +784,8 @@ void main() {
 
     // Reflection
     if( current_m.phys.x != 0.0 ) {
+#ifdef ENABLE_REFLECTIONS
+      COUNT_RAY_COST(cost_bounces);
       current_ray.origin = current_hit.pos + (limit_acne_factor * current_hit.normal);
       current_ray.direction = current_hit.ray_reflect;
       if( !ray_hit_first_reflection(current_ray, current_hit) ) {
@@ -473,34 +795,61 @@ void main() {
         break;
       }
       compute_intersection_data(current_ray, current_hit);
+#ifdef ENABLE_MULTI_HIT_TRANSPARENCY
+      // New direction, any further transparency needs a new traversal
+      transparency_hits_valid = false;
+#endif
 
       // Shade the reflection - But with shadows disabled, this is slow enough already
       // Mix based on the reflectivity of the current surface
       shade_factor *= current_m.phys.x;
       vec4 reflected_shade = shade_phong( current_hit, limit_subray_shadows_enabled );
       shade = mix(shade, reflected_shade, shade_factor);
+#else
+      break;
+#endif
     }
     
     // Transparency / Refraction
     else if( current_m.phys.y != 0.0 ) {
+#ifdef ENABLE_TRANSPARENCY
+      COUNT_RAY_COST(cost_bounces);
       // Continue the ray from just the other side of the surface
       current_ray.origin = current_hit.pos + (limit_acne_factor * (- hit.normal));
       current_ray.direction = current_ray.direction; // TODO: Refraction
+#ifdef ENABLE_MULTI_HIT_TRANSPARENCY
+      if( !transparency_hits_valid ) {
+        ray_hit_multi(current_ray, transparency_hits);
+        transparency_hits_valid = true;
+      }
+      if( !multi_hit_next_transparency(current_ray, transparency_hits, current_hit, current_hit) ) {
+        // We failed to hit anything
+        break;
+      }
+#else
       if( !ray_hit_first_transparency(current_ray, current_hit, current_hit) ) {
         // We failed to hit anything
         break;
       }
       compute_intersection_data(current_ray, current_hit);
+#endif
 
       // Shade the next hit on the ray, shadows disabled
       // Mix based on transparency of the current surface
       shade_factor *= current_m.phys.y;
       vec4 transparent_shade = shade_phong( current_hit, limit_subray_shadows_enabled );
       shade = mix(shade, transparent_shade, shade_factor);
+#else
+      break;
+#endif
     }
     current_m = primitive_material(current_hit.i);
     depth++;
   }
 
   fragColor = shade;
+#ifdef ENABLE_RAY_COST_COUNTERS
+  rayCostOut = uvec4(cost_primitive_tests, cost_bounces, cost_shadow_rays, 0u);
+#endif
 }
+#endif
@@ -0,0 +1,33 @@
+#version 300 es
+
+// Multi-view atlas (ENABLE_MULTIVIEW in raytrace_quad.frag)
+// One instance per view - The full screen quad, shrunk to that view's size in its cell of the atlas
+
+layout (location=0) in vec3 position;
+layout (location=1) in vec2 texCoord;
+
+// As raytrace_quad.frag, a mismatch fails to link
+const int max_iNumViews = 16;
+// Width and height of each view, in pixels
+uniform vec4 multiViewParams[max_iNumViews];
+
+// Cells across the atlas, view 0 at the bottom left
+uniform int atlasColumns;
+// Size of a cell and of the whole atlas, in pixels
+uniform vec2 atlasCellSize;
+uniform vec2 atlasSize;
+
+out vec3 fragPos;
+out vec2 vUV;
+flat out int vView;
+
+void main() {
+  vView = gl_InstanceID;
+  vec2 cell = vec2(gl_InstanceID % atlasColumns, gl_InstanceID / atlasColumns);
+  vec2 pixel = cell * atlasCellSize + ((position.xy * 0.5) + 0.5) * multiViewParams[gl_InstanceID].xy;
+  vec2 p = (pixel / atlasSize) * 2.0 - 1.0;
+
+  fragPos = position;
+  vUV = texCoord;
+  gl_Position = vec4(p, position.z, 1.0);
+}